@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2011 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MDBOOT_H
+#define _MDBOOT_H
+
+#include <stdint.h>
+
+/*
+ * Boot stub protocol. The stub is sent through the boot ROM, announces
+ * itself with MDBOOT_READY and receives the loader:
+ *
+ *  host: MDBOOT_CMD_BAUD rate(4) cur_rate(4)
+ *                                             stub: MDBOOT_CMD_BAUD_RESPONSE status(1)
+ *  host: MDBOOT_CMD_LOAD struct mdboot_load_t data
+ *                                             stub: MDBOOT_CMD_LOAD_RESPONSE status(1)
+ *
+ * Multi-byte fields are in network byte order. cur_rate is the rate the
+ * stub runs at: the boot ROM may have raised it above UART_BOOT_BAUD.
+ * The stub switches the rate after the response has left the UART. It
+ * returns to the old rate if the next request is broken or does not
+ * arrive in time.
+ *
+ * The loader is placed at its link address MDBOOT_LOAD_ADDR and started at
+ * MDBOOT_LOAD_ADDR + MDBOOT_ENTRY_OFFSET with the current baud rate in R4.
+ */
+
+#define MDBOOT_READY "BOOT"
+
+enum mdboot_cmd_t {
+   MDBOOT_CMD_BAUD          = 'b',
+   MDBOOT_CMD_BAUD_RESPONSE = 'B',
+   MDBOOT_CMD_LOAD          = 'l',
+   MDBOOT_CMD_LOAD_RESPONSE = 'L'
+};
+
+enum mdboot_status_t {
+   MDBOOT_OK = 0,
+   MDBOOT_ERR_PARAM = 1,   /* rate can not be set, wrong size */
+   MDBOOT_ERR_TIMEOUT = 2, /* data does not arrive */
+   MDBOOT_ERR_CRC = 3,
+   MDBOOT_ERR_DATA = 4     /* broken compressed data */
+};
+
+/* mdboot_load_t flags */
+#define MDBOOT_LOAD_LZ 0x01  /* data is mdlz compressed */
+
+struct mdboot_load_t {
+   uint8_t flags;
+   uint32_t size;       /* loader size */
+   uint32_t data_size;  /* size of the data that follows */
+   uint32_t crc32;      /* mdproto_crc32() of the loader */
+} __attribute__((packed));
+
+/* Loader link address and largest loader */
+#define MDBOOT_LOAD_ADDR 0x2400
+#define MDBOOT_LOAD_MAX_SIZE 0x1c00
+#define MDBOOT_ENTRY_OFFSET 4
+
+/* Largest compressed loader */
+#define MDBOOT_LZ_MAX_SIZE 0x1800
+
+#endif /* _MDBOOT_H */
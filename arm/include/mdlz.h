@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _MDLZ_H
+#define _MDLZ_H
+
+#include <stdint.h>
+
+/*
+ * Byte oriented LZ used on the loader link.
+ *
+ * Tokens:
+ *  0lllllll <l+1 bytes>    literal, 1..128 bytes
+ *  10llllll v              run of l+3 bytes of value v, 3..65
+ *  10111111 v nn nn        run of nnnn bytes of value v
+ *  11llllll oo oo          l+3 bytes at distance oooo back, 3..66
+ *
+ * Every mdlz_compress() block is a sequence of complete tokens. Matches
+ * may refer to the data of previous blocks up to MDLZ_MAX_OFFSET bytes back.
+ */
+
+#define MDLZ_MIN_LEN      3
+#define MDLZ_MAX_LITERAL  128
+#define MDLZ_SHORT_RUN    (0x3e + MDLZ_MIN_LEN)
+#define MDLZ_MAX_RUN      0xffff
+#define MDLZ_MAX_MATCH    (0x3f + MDLZ_MIN_LEN)
+#define MDLZ_MAX_OFFSET   0xffff
+
+/* Hash table size. Power of 2 */
+#ifndef MDLZ_HASH_SIZE
+#define MDLZ_HASH_SIZE 256
+#endif
+
+struct mdlz_enc_t {
+   const volatile uint8_t *htab[MDLZ_HASH_SIZE];
+};
+
+void mdlz_enc_init(struct mdlz_enc_t *enc);
+unsigned mdlz_compress(struct mdlz_enc_t *enc,
+      const volatile uint8_t *src, unsigned *src_size, unsigned hist,
+      uint8_t *dst, unsigned dst_size);
+int mdlz_decode(const uint8_t *src, unsigned src_size,
+      unsigned max_size, unsigned hist,
+      void (*put)(void *ctx, uint8_t b),
+      uint8_t (*get)(void *ctx, unsigned offset),
+      void *ctx);
+
+#endif /* _MDLZ_H */
@@ -34,6 +34,23 @@ enum mdproto_cmd_t {
    MDPROTO_CMD_FLASH_ERASE_SECTOR_RESPONSE = 'U',
    MDPROTO_CMD_FLASH_CHANGE_MODE     = 't',
    MDPROTO_CMD_FLASH_CHANGE_MODE_RESPONSE = 'T',
+   MDPROTO_CMD_SET_PARAM          = 's',
+   MDPROTO_CMD_SET_PARAM_RESPONSE = 'S',
+   MDPROTO_CMD_NAK                = '!',
+   MDPROTO_CMD_MEM_READ_LZ          = 'r',
+   MDPROTO_CMD_MEM_READ_LZ_RESPONSE = 'R',
+   MDPROTO_CMD_FLASH_PROGRAM_LZ          = 'q',
+   MDPROTO_CMD_FLASH_PROGRAM_LZ_RESPONSE = 'Q',
+   MDPROTO_CMD_MEM_CRC32          = 'c',
+   MDPROTO_CMD_MEM_CRC32_RESPONSE = 'C',
+   MDPROTO_CMD_FLASH_BLANK_CHECK  = 'b',
+   MDPROTO_CMD_FLASH_BLANK_CHECK_RESPONSE = 'B',
+   MDPROTO_CMD_FLASH_STAGE        = 'g',
+   MDPROTO_CMD_FLASH_STAGE_RESPONSE = 'G',
+   MDPROTO_CMD_FLASH_COMMIT       = 'k',
+   MDPROTO_CMD_FLASH_COMMIT_RESPONSE = 'K',
+   MDPROTO_CMD_HELLO              = 'h',
+   MDPROTO_CMD_HELLO_RESPONSE     = 'H',
 
    MDPROTO_STATUS_OK = '+',
    MDPROTO_STATUS_WRONG_CMD = '?',
@@ -44,17 +61,146 @@ enum mdproto_cmd_t {
    MDPROTO_STATUS_WRONG_PARAM='-'
 };
 
+/* Size of the frame buffer data field (id, data, seq). Host and loader
+ * may be built with different sizes, frame size is negotiated with
+ * MDPROTO_PARAM_MTU */
+#ifndef MDPROTO_CMD_BUF_SIZE
+#define MDPROTO_CMD_BUF_SIZE 4100
+#endif
+
 struct mdproto_cmd_buf_t {
    uint16_t size;
    union {
       uint8_t id;
-      uint8_t p[512];
+      uint8_t p[MDPROTO_CMD_BUF_SIZE];
    } data;
-   uint8_t _csum_buf;
+   uint8_t _csum_buf[4];
 } __attribute__((packed));
 #define MDPROTO_CMD_SIZE(_p) ((((_p).size << 8) | (((_p).size >> 8) & 0xff)) & 0xffff)
+
+/* Maximum size of data in a frame at session start */
 #define MDPROTO_CMD_MAX_RAW_DATA_SIZE 508
 
+/* Largest MDPROTO_PARAM_MTU the frame buffer allows */
+#define MDPROTO_MTU_MAX (MDPROTO_CMD_BUF_SIZE-4)
+
+/* Largest frame on the wire with the given MTU: size, id, data, seq, fcs */
+#define MDPROTO_FRAME_SIZE(_mtu) (2+1+(_mtu)+1+4)
+
+/* MDPROTO_CMD_MEM_READ_LZ: same request as MDPROTO_CMD_MEM_READ. Every
+ * response frame is a mdlz block of at most MDPROTO_LZ_FRAME_RAW_MAX
+ * bytes of data. Matches do not cross request boundary */
+#define MDPROTO_LZ_FRAME_RAW_MAX 8192
+
+/* MDPROTO_CMD_FLASH_PROGRAM_LZ: address (4 bytes), mdlz block. Matches
+ * refer to the flash contents before the address. Response is the same
+ * as for MDPROTO_CMD_FLASH_PROGRAM */
+
+/* MDPROTO_CMD_FLASH_PROGRAM, MDPROTO_CMD_FLASH_PROGRAM_LZ: words that
+ * already hold the value are not programmed */
+
+/* Staged programming. Data is copied to one of the staging slots with
+ * MDPROTO_CMD_FLASH_STAGE and programmed with MDPROTO_CMD_FLASH_COMMIT in
+ * the background, while the next slot is being received.
+ *
+ * MDPROTO_CMD_FLASH_STAGE: slot (1 byte), offset in the slot (2 bytes),
+ * data. Response: result (1 byte). Staging to the slot being committed
+ * waits for the commit.
+ *
+ * MDPROTO_CMD_FLASH_COMMIT: slot (1 byte), address (4 bytes), size (2 bytes,
+ * even), flags (1 byte, MDPROTO_COMMIT_*). Waits for the previous commit
+ * and responds with its result (1 byte). The new commit is started only
+ * if the previous one succeeded. Commit of size 0 without flags only
+ * waits for the previous one. Commit with MDPROTO_COMMIT_ERASE starts a
+ * new sector: it waits for the previous commit, but drops its result.
+ * The host collects each sector's result before erasing the next.
+ */
+#define MDPROTO_STAGE_SLOTS 2
+#define MDPROTO_STAGE_SLOT_SIZE 1536
+
+/* Erase the sector at address before programming */
+#define MDPROTO_COMMIT_ERASE 0x01
+
+/* Results of flash commands other than 0 (ok) */
+enum mdproto_flash_err_t {
+   /* Operation did not complete before the deadline */
+   MDPROTO_FLASH_ERR_TIMEOUT = -1,
+   /* Operation completed, but data is wrong */
+   MDPROTO_FLASH_ERR_VERIFY = -2,
+   /* Broken compressed data */
+   MDPROTO_FLASH_ERR_DATA = -3,
+   /* Chip reported failure (DQ5) */
+   MDPROTO_FLASH_ERR_DEVICE = -4
+};
+
+/* Longest flash operation the loader waits for before it reports
+ * MDPROTO_FLASH_ERR_TIMEOUT, ms. Shorter than the host response timeout */
+#define MDPROTO_FLASH_MAX_WAIT 20000
+
+/* MDPROTO_CMD_MEM_CRC32: same request as MDPROTO_CMD_MEM_READ. Response
+ * is CRC-32 of the range (4 bytes, network byte order) */
+
+/* MDPROTO_CMD_FLASH_BLANK_CHECK: same request as MDPROTO_CMD_MEM_READ.
+ * Response is 1 byte: 0 - all bytes of the range are 0xff, 1 - not blank */
+
+/* Sequence number of the received frame. Valid in window mode only,
+ * after mdproto_pkt_check() */
+#define MDPROTO_CMD_SEQ(_p) ((_p).data.p[MDPROTO_CMD_SIZE(_p)])
+
+/* MDPROTO_CMD_SET_PARAM parameters.
+ * Request: param id (1 byte), value (4 bytes, network byte order)
+ * Response: result (1 byte, 0 - ok), accepted value (4 bytes, network byte order)
+ * New value takes effect after the response is sent.
+ */
+enum mdproto_param_t {
+   /* Maximum number of outstanding requests (credits). 0 - stop-and-wait.
+    * In window mode every frame has a sequence number byte just
+    * before the checksum. Response frames carry the sequence number of
+    * the request. Errors are reported with MDPROTO_CMD_NAK frames
+    * instead of raw status bytes.
+    */
+   MDPROTO_PARAM_WINDOW = 0x01,
+   /* UART baud rate. The loader drops back to the previous rate if the
+    * first request at the new rate is not received correctly */
+   MDPROTO_PARAM_BAUD = 0x02,
+   /* Frame check sequence, enum mdproto_fcs_t */
+   MDPROTO_PARAM_FCS = 0x03,
+   /* Maximum size of data in a frame, both directions. At least
+    * MDPROTO_CMD_MAX_RAW_DATA_SIZE (default). The loader may accept a
+    * smaller value. Set before MDPROTO_PARAM_WINDOW: the window is limited
+    * by the frame size */
+   MDPROTO_PARAM_MTU = 0x04,
+   /* Baud rate the loader is running at. Set when the boot ROM raised
+    * the rate before the loader was sent. Corrects the UART clock
+    * derived from the divisor, the divisor is not changed */
+   MDPROTO_PARAM_CUR_BAUD = 0x05
+};
+
+/* Frame check sequence. Covers size and data fields. CRCs are sent in
+ * network byte order */
+enum mdproto_fcs_t {
+   /* 8-bit two's complement sum. Default */
+   MDPROTO_FCS_SUM8 = 0,
+   /* CRC-16/CCITT-FALSE: poly 0x1021, init 0xffff */
+   MDPROTO_FCS_CRC16 = 1,
+   /* CRC-32/IEEE 802.3 */
+   MDPROTO_FCS_CRC32 = 2
+};
+
+/* Link state shared by host and loader */
+struct mdproto_link_t {
+   /* window size, 0 - window mode disabled */
+   unsigned window;
+   /* sequence number of the outgoing frame */
+   uint8_t seq;
+   /* frame check sequence, enum mdproto_fcs_t */
+   unsigned fcs;
+   /* maximum size of data in a frame */
+   unsigned mtu;
+};
+
+extern struct mdproto_link_t mdproto_link;
+
 struct mdproto_cmd_flash_info_t {
 
    /* software id. cmd 90h  */
@@ -98,15 +244,52 @@ struct mdproto_cmd_flash_info_t {
 
 } __attribute__((packed));
 
+/* Protocol version in MDPROTO_CMD_HELLO response */
+#define MDPROTO_VERSION 1
+
+/* Optional loader features */
+enum mdproto_feature_t {
+   MDPROTO_FEATURE_WINDOW      = 0x0001, /* MDPROTO_PARAM_WINDOW */
+   MDPROTO_FEATURE_BAUD        = 0x0002, /* MDPROTO_PARAM_BAUD */
+   MDPROTO_FEATURE_FCS         = 0x0004, /* MDPROTO_PARAM_FCS */
+   MDPROTO_FEATURE_MTU         = 0x0008, /* MDPROTO_PARAM_MTU */
+   MDPROTO_FEATURE_MEM_READ_LZ = 0x0010,
+   MDPROTO_FEATURE_FLASH_PROGRAM_LZ = 0x0020,
+   MDPROTO_FEATURE_MEM_CRC32   = 0x0040,
+   MDPROTO_FEATURE_FLASH_BLANK_CHECK = 0x0080,
+   MDPROTO_FEATURE_FLASH_STAGE = 0x0100, /* FLASH_STAGE, FLASH_COMMIT */
+   MDPROTO_FEATURE_CUR_BAUD    = 0x0200  /* MDPROTO_PARAM_CUR_BAUD */
+};
+
+#define MDPROTO_HELLO_VERSION_SIZE 32
 
+/* MDPROTO_CMD_HELLO: no data. Response describes the loader. Multi-byte
+ * fields are in network byte order */
+struct mdproto_hello_t {
+   uint8_t proto_version;     /* MDPROTO_VERSION */
+   uint8_t gps_version;       /* enum sirfgps_version_e */
+   uint8_t flash_bus_width;   /* bits */
+   uint8_t stage_slots;
+   uint32_t features;         /* enum mdproto_feature_t */
+   uint32_t flash_base;
+   uint32_t uart_clock;       /* rate = clock / (divisor + 1). 0 - unknown */
+   uint16_t mtu_max;          /* largest MDPROTO_PARAM_MTU */
+   uint16_t stage_slot_size;
+   char version[MDPROTO_HELLO_VERSION_SIZE]; /* loader build, NUL terminated */
+   struct mdproto_cmd_flash_info_t flash_info; /* MDPROTO_CMD_FLASH_INFO response */
+} __attribute__((packed));
 
 int mdproto_pkt_init(struct mdproto_cmd_buf_t *buf,
       unsigned cmd_id,
       void *raw_data,
       unsigned raw_data_size);
+int mdproto_pkt_finish(struct mdproto_cmd_buf_t *buf,
+      unsigned cmd_id,
+      unsigned raw_data_size);
 
 uint8_t mdproto_pkt_csum(void *buf, size_t size);
-int mdproto_pkt_append(struct mdproto_cmd_buf_t *buf,
-      void *data, unsigned appended_size);
+unsigned mdproto_fcs_size(void);
+uint32_t mdproto_crc32(uint32_t crc, const void *buf, size_t size);
+int mdproto_pkt_check(struct mdproto_cmd_buf_t *buf);
 
 #endif
@@ -57,9 +57,42 @@ struct uart_t {
 #define UART_READ_TIMEOUT 10000000
 #endif
 
+/* Receive ring buffer size. Power of 2 */
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE 2048
+#endif
+
+/* Transmit ring buffer size. Power of 2 */
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE 512
+#endif
+
+/* Polls without transmit progress before the UART is considered stuck */
+#ifndef UART_TX_TIMEOUT
+#define UART_TX_TIMEOUT 100000
+#endif
+
+/* Baud rate set by the boot ROM */
+#ifndef UART_BOOT_BAUD
+#define UART_BOOT_BAUD 38400
+#endif
+
+/* Maximum baud rate error, percents */
+#ifndef UART_BAUD_TOLERANCE
+#define UART_BAUD_TOLERANCE 3
+#endif
+
 void uart1_reset(void);
+void uart1_poll(void);
+void uart1_flush(void);
+int uart1_baud_div(unsigned rate);
+unsigned uart1_clock(void);
+void uart1_set_baud(unsigned rate, unsigned div);
+void uart1_restore_baud(void);
+void uart1_set_rate(unsigned rate);
 ssize_t uart1_write(const char *src, size_t size);
 ssize_t uart1_read(char *dst, size_t size);
+extern void (*uart1_idle)(void);
 
 #ifdef USE_UART_A
 extern volatile struct uart_t *UART_A;
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2011 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Boot stub. Sent through the boot ROM instead of the loader: raises the
+ * baud rate and receives the loader at the new rate. See mdboot.h
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mdboot.h"
+#include "mdlz.h"
+#include "mdproto.h"
+#include "uart.h"
+
+/* Polls without received data before the line is considered quiet */
+#define BOOT_DRAIN_POLLS 100000
+
+static volatile struct uart_t *UART = (struct uart_t *)0x80030000;
+
+/* Current baud rate */
+static unsigned rate = UART_BOOT_BAUD;
+
+/* Compressed loader */
+static uint8_t lz_buf[MDBOOT_LZ_MAX_SIZE] __attribute__((section(".bufs")));
+static uint8_t *lz_dst;
+
+int main(void);
+
+/* bootstart.S */
+void stage2_start(unsigned baud, unsigned entry);
+
+static void wait(unsigned n)
+{
+   static volatile unsigned i;
+   for (i=0; i < n; i++);
+}
+
+static void put_byte(uint8_t c)
+{
+   while (UART->status & UART_STATUS_TXA_FULL);
+   UART->tx = c;
+}
+
+/* Wait until the last byte leaves the shift register */
+static void flush(void)
+{
+   unsigned j;
+
+   for (j=0; j<UART_TX_TIMEOUT; j++) {
+      if (UART->status & UART_STATUS_TXA_EMPTY)
+	 break;
+   }
+   wait(10000);
+}
+
+/* Next received byte, -1 on timeout */
+static int get_byte(unsigned tmout)
+{
+   for (; tmout != 0; tmout--) {
+      if (UART->status & UART_STATUS_RXA_READY)
+	 return UART->rx & 0xff;
+   }
+
+   return -1;
+}
+
+static int read_full(uint8_t *dst, unsigned size)
+{
+   int c;
+
+   while (size--) {
+      if ((c = get_byte(UART_READ_TIMEOUT)) < 0)
+	 return -1;
+      *dst++ = (uint8_t)c;
+   }
+
+   return 0;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+   return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Discard input until the line is quiet */
+static void drain(void)
+{
+   while (get_byte(BOOT_DRAIN_POLLS) >= 0);
+}
+
+static void respond(uint8_t id, uint8_t status)
+{
+   put_byte(id);
+   put_byte(status);
+}
+
+/* Divisor for the rate, -1 if it can not be set within
+ * UART_BAUD_TOLERANCE. Same as uart1_baud_div() */
+static int baud_div(unsigned new_rate)
+{
+   unsigned clk, div, real_rate;
+
+   if (new_rate == 0)
+      return -1;
+
+   clk = ((unsigned)UART->baud + 1) * rate;
+   div = (clk + new_rate / 2) / new_rate;
+   if ((div == 0) || (div > 0x10000))
+      return -1;
+
+   real_rate = clk / div;
+   if (real_rate > new_rate) {
+      if ((real_rate - new_rate) * 100 > new_rate * UART_BAUD_TOLERANCE)
+	 return -1;
+   }else {
+      if ((new_rate - real_rate) * 100 > new_rate * UART_BAUD_TOLERANCE)
+	 return -1;
+   }
+
+   return (int)(div - 1);
+}
+
+static void lz_put(void *ctx, uint8_t b)
+{
+   (void)ctx;
+   *lz_dst++ = b;
+}
+
+static uint8_t lz_get(void *ctx, unsigned offset)
+{
+   (void)ctx;
+   return *(lz_dst - offset);
+}
+
+static int load(void)
+{
+   uint8_t hdr[sizeof(struct mdboot_load_t)];
+   uint8_t *dst;
+   unsigned flags, size, data_size;
+   uint32_t crc;
+
+   if (read_full(hdr, sizeof(hdr)) != 0)
+      return MDBOOT_ERR_TIMEOUT;
+
+   flags = hdr[0];
+   size = get_u32(&hdr[1]);
+   data_size = get_u32(&hdr[5]);
+   crc = get_u32(&hdr[9]);
+
+   if ((size == 0) || (size > MDBOOT_LOAD_MAX_SIZE)
+	 || ((flags & MDBOOT_LOAD_LZ) && (data_size > MDBOOT_LZ_MAX_SIZE))
+	 || (!(flags & MDBOOT_LOAD_LZ) && (data_size != size))) {
+      drain();
+      return MDBOOT_ERR_PARAM;
+   }
+
+   dst = (flags & MDBOOT_LOAD_LZ) ? lz_buf : (uint8_t *)MDBOOT_LOAD_ADDR;
+   if (read_full(dst, data_size) != 0)
+      return MDBOOT_ERR_TIMEOUT;
+
+   if (flags & MDBOOT_LOAD_LZ) {
+      lz_dst = (uint8_t *)MDBOOT_LOAD_ADDR;
+      if (mdlz_decode(lz_buf, data_size, size, 0, lz_put, lz_get, NULL) != (int)size)
+	 return MDBOOT_ERR_DATA;
+   }
+
+   if (mdproto_crc32(0, (uint8_t *)MDBOOT_LOAD_ADDR, size) != crc)
+      return MDBOOT_ERR_CRC;
+
+   return MDBOOT_OK;
+}
+
+int main(void)
+{
+   int c, div, status;
+   unsigned i;
+   uint8_t req[8];
+   /* Rate before the last switch, not confirmed yet */
+   unsigned prev_rate;
+   uint16_t prev_div;
+
+   prev_rate = 0;
+   prev_div = 0;
+
+   for (i=0; i < sizeof(MDBOOT_READY)-1; i++)
+      put_byte((uint8_t)MDBOOT_READY[i]);
+
+   for (;;) {
+      c = get_byte(UART_READ_TIMEOUT);
+      switch (c) {
+	 case MDBOOT_CMD_BAUD:
+	    if (read_full(req, sizeof(req)) != 0) {
+	       status = MDBOOT_ERR_TIMEOUT;
+	       break;
+	    }
+	    /* Rate set by the boot ROM, the divisor is derived from it */
+	    if (get_u32(&req[4]) != 0)
+	       rate = get_u32(&req[4]);
+	    div = baud_div(get_u32(req));
+	    if (div < 0) {
+	       status = MDBOOT_ERR_PARAM;
+	       break;
+	    }
+	    respond(MDBOOT_CMD_BAUD_RESPONSE, MDBOOT_OK);
+	    flush();
+	    prev_rate = rate;
+	    prev_div = UART->baud;
+	    UART->baud = (uint16_t)div;
+	    rate = get_u32(req);
+	    continue;
+	 case MDBOOT_CMD_LOAD:
+	    status = load();
+	    if (status == MDBOOT_OK) {
+	       respond(MDBOOT_CMD_LOAD_RESPONSE, MDBOOT_OK);
+	       flush();
+	       stage2_start(rate, MDBOOT_LOAD_ADDR + MDBOOT_ENTRY_OFFSET);
+	    }
+	    break;
+	 default:
+	    /* Idle line at the confirmed rate */
+	    if (prev_rate == 0)
+	       continue;
+	    status = MDBOOT_ERR_TIMEOUT;
+	    break;
+      }
+
+      /* First request at the new rate failed: return to the old one */
+      if (prev_rate != 0) {
+	 drain();
+	 UART->baud = prev_div;
+	 rate = prev_rate;
+	 prev_rate = 0;
+	 continue;
+      }
+
+      respond(c == MDBOOT_CMD_BAUD ? MDBOOT_CMD_BAUD_RESPONSE : MDBOOT_CMD_LOAD_RESPONSE,
+	    (uint8_t)status);
+   }
+
+   return 0;
+}
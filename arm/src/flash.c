@@ -16,15 +16,43 @@
 
 
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "sirfgps.h"
 #include "sirfgpsconf.h"
 
+#include "mdlz.h"
 #include "mdproto.h"
+#include "uart.h"
 
 #define EXT_SRAM_CSN0 0x40000000
 
+/* CFI primary command set: AMD/Fujitsu standard */
+#define CFI_ALG_AMD_STD 0x0002
+
+/* Largest write buffer used, words */
+#define FLASH_WBUF_MAX_WORDS 256
+
+/* Status bits */
+#define FLASH_DQ7 0x80
+#define FLASH_DQ6 0x40
+#define FLASH_DQ5 0x20
+
+/* Polls per millisecond. One poll takes at least a microsecond */
+#define FLASH_POLLS_PER_MS 1000
+
+/* Longest deadline, polls. Half of MDPROTO_FLASH_MAX_WAIT: leaves room
+ * for polls up to two microseconds long */
+#define FLASH_MAX_POLLS (MDPROTO_FLASH_MAX_WAIT / 2 * FLASH_POLLS_PER_MS)
+
+/* JEDEC manufacturers of AMD command set chips */
+#define JEDEC_MANUF_AMD 0x01
+#define JEDEC_MANUF_FUJITSU 0x04
+
+/* Polls without CFI timeouts */
+#define FLASH_DEFAULT_POLLS 1000000
+
 
 static void flash_sdp_null_unprotect(void);
 static void flash_sdp_16b_unprotect(void);
@@ -32,8 +60,26 @@ static void flash_16b_cfi_query(void);
 static void flash_16b_jedec_id_query(void);
 static void flash_16b_read_array_mode(void);
 static int flash_16b_program_word(unsigned addr, uint16_t word);
+static void flash_16b_cmdset_detect(void);
+static void flash_16b_wbuf_write(unsigned addr, unsigned n);
+static void flash_16b_wbuf_abort_reset(void);
+static int flash_16b_wbuf_flush(void);
+static int flash_16b_queue_word(unsigned addr, uint16_t word);
+static void flash_16b_bypass_enter(void);
+static void flash_16b_bypass_exit(void);
+static int flash_16b_data_status(unsigned addr, uint16_t word);
+static int flash_16b_data_poll(unsigned addr, uint16_t word, unsigned polls);
+static int flash_16b_toggle_status(unsigned addr);
+static int flash_16b_toggle_poll(unsigned addr, unsigned polls);
+static void flash_job_next(void);
+static unsigned cfi_polls(unsigned typ, unsigned max, unsigned polls_per_unit);
 int flash_16b_erase_sector(unsigned addr);
 int flash_16b_program(unsigned addr, void *buf, unsigned size);
+int flash_16b_program_lz(unsigned addr, const uint8_t *src, unsigned src_size);
+int flash_blank_check(unsigned from, unsigned size);
+int flash_job_start(unsigned addr, const uint8_t *src, unsigned size, int erase);
+void flash_job_poll(void);
+int flash_job_wait(void);
 
 extern volatile enum sirfgps_version_e gps_version; /* sirfmemdump.c */
 
@@ -44,11 +90,52 @@ static volatile uint16_t *flash __attribute__((aligned(__alignof__(uint16_t))));
 static volatile unsigned flash_bus_width = 16;
 static void (*flash_sdp_unprotect)(void) = &flash_sdp_16b_unprotect;
 
+/* Write buffer size in words, 0 - word programming only */
+static unsigned flash_wbuf_words;
+
+/* AMD command set: DQ5 reports exceeded time limits */
+static unsigned flash_amd;
+
+/* Unlock bypass: supported, active */
+static unsigned flash_bypass;
+static unsigned flash_bypass_on;
+
+/* Operation deadlines, polls. From CFI maximum timeouts */
+static unsigned flash_word_polls = FLASH_DEFAULT_POLLS;
+static unsigned flash_wbuf_polls = FLASH_DEFAULT_POLLS;
+static unsigned flash_erase_polls = FLASH_DEFAULT_POLLS;
+
+/* Words queued for buffered programming */
+static struct {
+   unsigned addr;  /* word address of the first word */
+   unsigned count;
+} wbuf;
+
+/* Background erase / program of a staged block */
+enum flash_job_state_t {
+   FLASH_JOB_IDLE = 0,
+   FLASH_JOB_ERASE,
+   FLASH_JOB_PROGRAM
+};
+
+static struct {
+   enum flash_job_state_t state;
+   unsigned addr;       /* word address of the next word */
+   const uint8_t *src;  /* next word */
+   unsigned words;      /* words left */
+   unsigned poll_addr;  /* word address being polled */
+   uint16_t poll_word;
+   unsigned polls;      /* polls left */
+   int res;
+} job;
+static uint16_t wbuf_data[FLASH_WBUF_MAX_WORDS] __attribute__((section(".bufs")));
+
 /* sirfmemdump.c  */
 void wait(unsigned n);
 
 int flash_init(void);
 int flash_get_info(struct mdproto_cmd_flash_info_t *dst);
+uint32_t flash_get_base(void);
 int flash_change_mode(unsigned mode);
 
 int flash_init()
@@ -101,12 +188,18 @@ int flash_init()
       /* JEDEC flash device (with SDP) */
 
 flash_16bit_done:
+      flash_16b_cmdset_detect();
       flash_16b_read_array_mode();
    } /* flash_bus_width=16 */
 
    return flash_bus_width;
 }
 
+uint32_t flash_get_base(void)
+{
+   return (uint32_t)flash;
+}
+
 int flash_change_mode(unsigned mode)
 {
    if (mode == 0x98)
@@ -214,18 +307,136 @@ int flash_16b_program(unsigned addr, void *buf, unsigned size)
 
    res = 0;
    buf_u8=(uint8_t *)buf;
+   flash_16b_bypass_enter();
    for (written=0; written<size; ++written) {
       word = (uint16_t)buf_u8[2*written]
 	 | (uint16_t)buf_u8[2*written+1] << 8;
-      r0 = flash_16b_program_word(addr+written, word);
+      /* Programmed already */
+      if (flash[addr+written] == word)
+	 continue;
+      r0 = flash_16b_queue_word(addr+written, word);
       /* do not break on errors */
       if (res == 0)
 	 res = r0;
    }
 
+   r0 = flash_16b_wbuf_flush();
+   if (res == 0)
+      res = r0;
+   flash_16b_bypass_exit();
+
    return res;
 }
 
+/* State of the mdlz stream being programmed */
+static struct {
+   unsigned addr;  /* word address of the next word */
+   unsigned pos;   /* decoded bytes */
+   uint8_t low;    /* low byte of the next word */
+   int res;
+} lz_prog;
+
+static void lz_prog_put(void *ctx, uint8_t b)
+{
+   uint16_t word;
+   int r0;
+
+   (void)ctx;
+   if ((lz_prog.pos++ & 1) == 0) {
+      lz_prog.low = b;
+      return;
+   }
+
+   word = (uint16_t)lz_prog.low | (uint16_t)b << 8;
+   /* Erased or programmed already */
+   if (flash[lz_prog.addr] != word) {
+      r0 = flash_16b_queue_word(lz_prog.addr, word);
+      /* do not break on errors */
+      if (lz_prog.res == 0)
+	 lz_prog.res = r0;
+   }
+   lz_prog.addr++;
+}
+
+/* Matches are read back from the flash or the write buffer */
+static uint8_t lz_prog_get(void *ctx, unsigned offset)
+{
+   unsigned b;
+   uint16_t word;
+
+   (void)ctx;
+   b = 2*lz_prog.addr + (lz_prog.pos & 1) - offset;
+   if (b == 2*lz_prog.addr)
+      return lz_prog.low;
+
+   if ((b/2 >= wbuf.addr) && (b/2 < wbuf.addr + wbuf.count))
+      word = wbuf_data[b/2 - wbuf.addr];
+   else
+      word = flash[b/2];
+
+   return (uint8_t)(word >> (8*(b & 1)));
+}
+
+/* Program mdlz block at word address addr. Matches may refer to the
+ * flash contents before addr */
+int flash_16b_program_lz(unsigned addr, const uint8_t *src, unsigned src_size)
+{
+   int size;
+   int r0;
+
+   lz_prog.addr = addr;
+   lz_prog.pos = 0;
+   lz_prog.res = 0;
+
+   flash_16b_bypass_enter();
+   size = mdlz_decode(src, src_size, 0xffffffff, 2*addr,
+	 lz_prog_put, lz_prog_get, NULL);
+   if (size < 0) {
+      wbuf.count = 0;
+      flash_16b_bypass_exit();
+      return MDPROTO_FLASH_ERR_DATA;
+   }
+
+   /* Odd size, pad with 0xff */
+   if (lz_prog.pos & 1)
+      lz_prog_put(NULL, 0xff);
+
+   r0 = flash_16b_wbuf_flush();
+   if (lz_prog.res == 0)
+      lz_prog.res = r0;
+   flash_16b_bypass_exit();
+
+   return lz_prog.res;
+}
+
+/* Check that size bytes from bus address from are erased. Returns 0 if
+ * blank, 1 otherwise */
+int flash_blank_check(unsigned from, unsigned size)
+{
+   const volatile uint32_t *p32;
+   const volatile uint8_t *p8;
+
+   p8 = (const volatile uint8_t *)from;
+   while ((size != 0) && (((unsigned)p8 % 4) != 0)) {
+      if (*p8++ != 0xff)
+	 return 1;
+      size--;
+   }
+
+   p32 = (const volatile uint32_t *)p8;
+   for (; size >= 4; size -= 4) {
+      if (*p32++ != 0xffffffff)
+	 return 1;
+   }
+
+   p8 = (const volatile uint8_t *)p32;
+   while (size-- != 0) {
+      if (*p8++ != 0xff)
+	 return 1;
+   }
+
+   return 0;
+}
 
 /* 98h CFI query */
 static void flash_16b_cfi_query(void)
@@ -266,33 +477,383 @@ static void flash_sdp_null_unprotect()
 
 static int flash_16b_program_word(unsigned addr, uint16_t word)
 {
-   unsigned volatile i;
    int err;
 
-   flash_sdp_unprotect();
-   flash[0x5555]=0xa0;
+   if (flash_bypass_on)
+      flash[addr]=0xa0;
+   else {
+      flash_sdp_unprotect();
+      flash[0x5555]=0xa0;
+   }
    flash[addr]=word;
 
-   i=0;
-   err = -2;
+   err = flash_16b_data_poll(addr, word, flash_word_polls);
+   if (err == 0)
+      return 0;
 
-   while (flash[addr] != word){
-      if (++i==1000000) {
-	 err = -1;
-	 break;
-      }
+   /* Unlock bypass reset first: F0h does not leave bypass mode. The
+    * next words are programmed with full commands */
+   flash_16b_bypass_exit();
+   flash_16b_read_array_mode();
+   return err;
+}
+
+/* Deadline from CFI typical and maximum timeout fields. Twice the
+ * maximum, at least 1000 polls, at most FLASH_MAX_POLLS: the host must
+ * get the error before its own timeout */
+static unsigned cfi_polls(unsigned typ, unsigned max, unsigned polls_per_unit)
+{
+   unsigned n;
+
+   typ &= 0xff;
+   max &= 0xff;
+   if ((typ == 0) || (typ + max > 20))
+      return FLASH_DEFAULT_POLLS;
+
+   n = (2u << (typ + max)) * polls_per_unit;
+   if (n > FLASH_MAX_POLLS)
+      return FLASH_MAX_POLLS;
+   return n < 1000 ? 1000 : n;
+}
+
+/* Chips with AMD command set have unlock bypass mode and may have
+ * write buffer */
+static void flash_16b_cmdset_detect(void)
+{
+   unsigned alg, n;
+
+   flash_wbuf_words = 0;
+   flash_amd = flash_bypass = flash_bypass_on = 0;
+   wbuf.count = 0;
+   flash_word_polls = flash_wbuf_polls = flash_erase_polls = FLASH_DEFAULT_POLLS;
+
+   /* Chips without CFI */
+   flash_16b_jedec_id_query();
+   n = flash[0] & 0xff;
+   if ((n == JEDEC_MANUF_AMD) || (n == JEDEC_MANUF_FUJITSU))
+      flash_amd = 1;
+   flash_16b_read_array_mode();
+
+   flash_16b_cfi_query();
+   if (((flash[0x10] & 0xff) != 'Q')
+	 || ((flash[0x11] & 0xff) != 'R')
+	 || ((flash[0x12] & 0xff) != 'Y'))
+      return;
+
+   /* Typical 2^N us (ms for erase), maximum 2^M times typical */
+   flash_word_polls = cfi_polls(flash[0x1f], flash[0x23], FLASH_POLLS_PER_MS / 1000);
+   flash_wbuf_polls = cfi_polls(flash[0x20], flash[0x24], FLASH_POLLS_PER_MS / 1000);
+   flash_erase_polls = cfi_polls(flash[0x21], flash[0x25], FLASH_POLLS_PER_MS);
+
+   alg = (flash[0x13] & 0xff) | (flash[0x14] & 0xff) << 8;
+   if (alg != CFI_ALG_AMD_STD)
+      return;
+   flash_amd = flash_bypass = 1;
+
+   n = (flash[0x2a] & 0xff) | (flash[0x2b] & 0xff) << 8;
+   if ((n < 2) || (n > 16))
+      return;
+
+   flash_wbuf_words = (1 << n) / 2;
+   if (flash_wbuf_words > FLASH_WBUF_MAX_WORDS)
+      flash_wbuf_words = FLASH_WBUF_MAX_WORDS;
+}
+
+/* Queue word for programming. Queued words are flushed when the word is
+ * not next to them or starts a new write buffer page */
+static int flash_16b_queue_word(unsigned addr, uint16_t word)
+{
+   int res;
+
+   if (flash_wbuf_words == 0)
+      return flash_16b_program_word(addr, word);
+
+   res = 0;
+   if ((wbuf.count != 0)
+	 && ((addr != wbuf.addr + wbuf.count) || ((addr % flash_wbuf_words) == 0)))
+      res = flash_16b_wbuf_flush();
+
+   if (wbuf.count == 0)
+      wbuf.addr = addr;
+   wbuf_data[wbuf.count++] = word;
+
+   return res;
+}
+
+/* Program queued words: Write to Buffer, Program Buffer to Flash */
+static int flash_16b_wbuf_flush(void)
+{
+   unsigned n, last;
+   int err;
+
+   if (wbuf.count == 0)
+      return 0;
+
+   if (wbuf.count == 1) {
+      wbuf.count = 0;
+      return flash_16b_program_word(wbuf.addr, wbuf_data[0]);
    }
 
-   if (flash[addr] == word)
+   n = wbuf.count;
+   last = wbuf.addr + n - 1;
+   wbuf.count = 0;
+
+   flash_16b_wbuf_write(wbuf.addr, n);
+
+   err = flash_16b_data_poll(last, wbuf_data[n-1], flash_wbuf_polls);
+   if (err == 0)
       return 0;
 
-   flash_16b_read_array_mode();
+   flash_16b_wbuf_abort_reset();
    return err;
 }
 
+/* Write to Buffer and Program Buffer to Flash of n words from wbuf_data
+ * at word address addr. Write buffer chips always need the unlock cycles */
+static void flash_16b_wbuf_write(unsigned addr, unsigned n)
+{
+   unsigned i;
+
+   flash_sdp_16b_unprotect();
+   flash[addr] = 0x25;
+   flash[addr] = n - 1;
+   for (i=0; i < n; i++)
+      flash[addr+i] = wbuf_data[i];
+   flash[addr] = 0x29;
+}
+
+/* Write-to-buffer abort reset: unlocked F0h, a bare reset does not
+ * leave the abort state */
+static void flash_16b_wbuf_abort_reset(void)
+{
+   flash_sdp_16b_unprotect();
+   flash[0x5555] = 0xf0;
+   wait(500);
+}
+
+/* Unlock bypass: program commands are two cycles long. Used only when
+ * there is no write buffer */
+static void flash_16b_bypass_enter(void)
+{
+   if (!flash_bypass || (flash_wbuf_words != 0))
+      return;
+   flash_sdp_16b_unprotect();
+   flash[0x5555] = 0x20;
+   flash_bypass_on = 1;
+}
+
+/* Unlock bypass reset */
+static void flash_16b_bypass_exit(void)
+{
+   if (!flash_bypass_on)
+      return;
+   flash[0] = 0x90;
+   flash[0] = 0x00;
+   flash_bypass_on = 0;
+}
+
+/*
+ * Data# polling. DQ7 reads as complement of the programmed data until
+ * the operation completes. DQ5 is set by AMD command set chips when the
+ * operation exceeds internal time limits. Returns 1 while busy.
+ */
+static int flash_16b_data_status(unsigned addr, uint16_t word)
+{
+   uint16_t status;
+
+   status = flash[addr];
+   if (((status ^ word) & FLASH_DQ7) != 0) {
+      if (!flash_amd || !(status & FLASH_DQ5))
+	 return 1;
+      status = flash[addr];
+      if (((status ^ word) & FLASH_DQ7) != 0)
+	 return MDPROTO_FLASH_ERR_DEVICE;
+   }
+
+   /* Other bits may become valid after DQ7 */
+   if (flash[addr] != word)
+      return MDPROTO_FLASH_ERR_VERIFY;
+
+   return 0;
+}
+
+static int flash_16b_data_poll(unsigned addr, uint16_t word, unsigned polls)
+{
+   int res;
+
+   while ((res = flash_16b_data_status(addr, word)) == 1) {
+      if (polls-- == 0)
+	 return MDPROTO_FLASH_ERR_TIMEOUT;
+      uart1_poll();
+   }
+
+   return res;
+}
+
+/* Toggle bit: DQ6 toggles on every read until the operation completes.
+ * Returns 1 while busy */
+static int flash_16b_toggle_status(unsigned addr)
+{
+   uint16_t s1, s2;
+
+   s1 = flash[addr];
+   s2 = flash[addr];
+   if (((s1 ^ s2) & FLASH_DQ6) == 0)
+      return 0;
+   if (!flash_amd || !(s2 & FLASH_DQ5))
+      return 1;
+
+   s1 = flash[addr];
+   s2 = flash[addr];
+   if (((s1 ^ s2) & FLASH_DQ6) == 0)
+      return 0;
+
+   return MDPROTO_FLASH_ERR_DEVICE;
+}
+
+static int flash_16b_toggle_poll(unsigned addr, unsigned polls)
+{
+   int res;
+
+   while ((res = flash_16b_toggle_status(addr)) == 1) {
+      if (polls-- == 0)
+	 return MDPROTO_FLASH_ERR_TIMEOUT;
+      uart1_poll();
+   }
+
+   return res;
+}
+
+/*
+ * Erase (optional) and program size bytes (even) from src at word address addr
+ * in the background. The job is advanced by flash_job_poll(), src must
+ * not change until it completes.
+ */
+int flash_job_start(unsigned addr, const uint8_t *src, unsigned size, int erase)
+{
+   job.addr = addr;
+   job.src = src;
+   job.words = size / 2;
+   job.res = 0;
+
+   if (erase) {
+      flash_sdp_unprotect();
+      flash[0x5555]=0x80;
+      flash_sdp_unprotect();
+      flash[addr]=0x30;
+      job.poll_addr = addr;
+      job.polls = flash_erase_polls;
+      job.state = FLASH_JOB_ERASE;
+   }else
+      flash_job_next();
+
+   return 0;
+}
+
+/* Start programming of the next word or write buffer page */
+static void flash_job_next(void)
+{
+   unsigned i, n;
+
+#define job_word(_i) ((uint16_t)job.src[2*(_i)] | (uint16_t)job.src[2*(_i)+1] << 8)
+
+   /* Skip words programmed already */
+   while ((job.words != 0) && (flash[job.addr] == job_word(0))) {
+      job.addr++;
+      job.src += 2;
+      job.words--;
+   }
+
+   if (job.words == 0) {
+      job.state = FLASH_JOB_IDLE;
+      return;
+   }
+
+   n = 1;
+   if (flash_wbuf_words != 0) {
+      n = flash_wbuf_words - job.addr % flash_wbuf_words;
+      if (n > job.words)
+	 n = job.words;
+   }
+
+   job.poll_addr = job.addr + n - 1;
+   job.poll_word = job_word(n - 1);
+
+   if (n == 1) {
+      flash_sdp_unprotect();
+      flash[0x5555]=0xa0;
+      flash[job.addr]=job_word(0);
+      job.polls = flash_word_polls;
+   }else {
+      /* Write buffer is free: other flash commands wait for the job */
+      for (i=0; i < n; i++)
+	 wbuf_data[i] = job_word(i);
+      flash_16b_wbuf_write(job.addr, n);
+      job.polls = flash_wbuf_polls;
+   }
+
+#undef job_word
+
+   job.addr += n;
+   job.src += 2*n;
+   job.words -= n;
+   job.state = FLASH_JOB_PROGRAM;
+}
+
+/* Advance the background job. Does not wait */
+void flash_job_poll(void)
+{
+   int res;
+
+   switch (job.state) {
+      case FLASH_JOB_ERASE:
+	 res = flash_16b_toggle_status(job.poll_addr);
+	 if ((res == 0) && (flash[job.poll_addr] != 0xffff))
+	    res = MDPROTO_FLASH_ERR_VERIFY;
+	 break;
+      case FLASH_JOB_PROGRAM:
+	 res = flash_16b_data_status(job.poll_addr, job.poll_word);
+	 break;
+      default:
+	 return;
+   }
+
+   if (res == 1) {
+      if (job.polls-- != 0)
+	 return;
+      res = MDPROTO_FLASH_ERR_TIMEOUT;
+   }
+
+   if (res != 0) {
+      if ((job.state == FLASH_JOB_PROGRAM) && (flash_wbuf_words != 0))
+	 flash_16b_wbuf_abort_reset();
+      else
+	 flash_16b_read_array_mode();
+      job.res = res;
+      job.state = FLASH_JOB_IDLE;
+      return;
+   }
+
+   flash_job_next();
+}
+
+/* Wait for the background job. Returns its result */
+int flash_job_wait(void)
+{
+   int res;
+
+   while (job.state != FLASH_JOB_IDLE) {
+      uart1_poll();
+      flash_job_poll();
+   }
+   res = job.res;
+   job.res = 0;
+
+   return res;
+}
+
 int flash_16b_erase_sector(unsigned addr)
 {
-   unsigned volatile i;
    int err;
 
    flash_sdp_unprotect();
@@ -300,16 +861,10 @@ int flash_16b_erase_sector(unsigned addr)
    flash_sdp_unprotect();
    flash[addr]=0x30;
 
-   i=0;
-   err = -2;
-   while(flash[addr]!=0xffff) {
-      if(++i>=1000000) {
-	 err = -1;
-	 break;
-      }
-   }
-
-   if (flash[addr] == 0xffff)
+   err = flash_16b_toggle_poll(addr, flash_erase_polls);
+   if ((err == 0) && (flash[addr] != 0xffff))
+      err = MDPROTO_FLASH_ERR_VERIFY;
+   if (err == 0)
       return 0;
 
    flash_16b_read_array_mode();
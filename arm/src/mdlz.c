@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mdlz.h"
+
+#define MDLZ_HASH(_p) ((((_p)[0] << 4) ^ ((_p)[1] << 2) ^ (_p)[2] ^ ((_p)[0] >> 4)) \
+      & (MDLZ_HASH_SIZE-1))
+
+void mdlz_enc_init(struct mdlz_enc_t *enc)
+{
+   unsigned i;
+
+   for (i=0; i < MDLZ_HASH_SIZE; i++)
+      enc->htab[i] = NULL;
+}
+
+static uint8_t *put_literals(uint8_t *op, const volatile uint8_t *lit, unsigned n)
+{
+   unsigned i;
+
+   *op++ = (uint8_t)(n-1);
+   for (i=0; i < n; i++)
+      *op++ = lit[i];
+
+   return op;
+}
+
+/*
+ * Compress up to *src_size bytes of src into dst. src is preceded by hist
+ * bytes of already sent data, matches may refer to it. src may be target
+ * memory: it is read through a volatile pointer.
+ * Returns size of the compressed block, *src_size is set to the number of
+ * bytes consumed.
+ */
+unsigned mdlz_compress(struct mdlz_enc_t *enc,
+      const volatile uint8_t *src, unsigned *src_size, unsigned hist,
+      uint8_t *dst, unsigned dst_size)
+{
+   const volatile uint8_t *ip, *lit, *end, *ref;
+   uint8_t *op, *oend;
+   unsigned len, nlit, tok_size;
+   unsigned h;
+
+   ip = lit = src;
+   end = src + *src_size;
+   op = dst;
+   oend = dst + dst_size;
+
+   if (hist > MDLZ_MAX_OFFSET)
+      hist = MDLZ_MAX_OFFSET;
+
+   while (ip < end) {
+      /* run  */
+      len = 1;
+      while ((ip + len < end) && (len < MDLZ_MAX_RUN) && (ip[len] == ip[0]))
+	 len++;
+
+      if (len >= MDLZ_MIN_LEN) {
+	 tok_size = len > MDLZ_SHORT_RUN ? 4 : 2;
+	 ref = NULL;
+      }else if (end - ip >= MDLZ_MIN_LEN) {
+	 /* match  */
+	 h = MDLZ_HASH(ip);
+	 ref = enc->htab[h];
+	 enc->htab[h] = ip;
+	 len = 0;
+	 if ((ref != NULL)
+	       && (ref < ip)
+	       && (ref >= src - hist)
+	       && ((unsigned)(ip - ref) <= MDLZ_MAX_OFFSET)) {
+	    while ((ip + len < end) && (len < MDLZ_MAX_MATCH) && (ref[len] == ip[len]))
+	       len++;
+	 }
+	 tok_size = 3;
+      }else
+	 len = 0;
+
+      if (len < MDLZ_MIN_LEN) {
+	 ip++;
+	 if (ip - lit == MDLZ_MAX_LITERAL) {
+	    if (oend - op < MDLZ_MAX_LITERAL+1)
+	       break;
+	    op = put_literals(op, lit, MDLZ_MAX_LITERAL);
+	    lit = ip;
+	 }
+	 continue;
+      }
+
+      nlit = (unsigned)(ip - lit);
+      if ((unsigned)(oend - op) < (nlit ? nlit + 1 : 0) + tok_size)
+	 break;
+      if (nlit)
+	 op = put_literals(op, lit, nlit);
+
+      if (ref == NULL) {
+	 if (len > MDLZ_SHORT_RUN) {
+	    *op++ = 0x80 | 0x3f;
+	    *op++ = ip[0];
+	    *op++ = (uint8_t)(len >> 8);
+	    *op++ = (uint8_t)len;
+	 }else {
+	    *op++ = (uint8_t)(0x80 | (len - MDLZ_MIN_LEN));
+	    *op++ = ip[0];
+	 }
+      }else {
+	 *op++ = (uint8_t)(0xc0 | (len - MDLZ_MIN_LEN));
+	 *op++ = (uint8_t)((ip - ref) >> 8);
+	 *op++ = (uint8_t)(ip - ref);
+      }
+      ip += len;
+      lit = ip;
+   }
+
+   /* Pending literals, as much as fits */
+   nlit = (unsigned)(ip - lit);
+   if ((nlit > 0) && (oend - op >= 2)) {
+      if (nlit > (unsigned)(oend - op) - 1)
+	 nlit = (unsigned)(oend - op) - 1;
+      op = put_literals(op, lit, nlit);
+      lit += nlit;
+   }
+
+   *src_size = (unsigned)(lit - src);
+   return (unsigned)(op - dst);
+}
+
+/*
+ * Decode block src. Output bytes are passed to put(), get() returns
+ * the byte `offset` bytes back from the current position. Data is
+ * preceded by hist bytes of the previously decoded blocks. At most
+ * max_size bytes are decoded.
+ * Returns size of the decoded data, -1 on error
+ */
+int mdlz_decode(const uint8_t *src, unsigned src_size,
+      unsigned max_size, unsigned hist,
+      void (*put)(void *ctx, uint8_t b),
+      uint8_t (*get)(void *ctx, unsigned offset),
+      void *ctx)
+{
+   unsigned i, len, offset, pos;
+   uint8_t t, v;
+   const uint8_t *ip, *iend;
+
+   ip = src;
+   iend = src + src_size;
+   pos = 0;
+
+   while (ip < iend) {
+      t = *ip++;
+      if ((t & 0x80) == 0) {
+	 /* literal  */
+	 len = t + 1;
+	 if (((unsigned)(iend - ip) < len) || (max_size - pos < len))
+	    return -1;
+	 for (i=0; i < len; i++)
+	    put(ctx, *ip++);
+      }else if ((t & 0xc0) == 0x80) {
+	 /* run  */
+	 if (ip >= iend)
+	    return -1;
+	 v = *ip++;
+	 if ((t & 0x3f) == 0x3f) {
+	    if (iend - ip < 2)
+	       return -1;
+	    len = (ip[0] << 8) | ip[1];
+	    ip += 2;
+	 }else
+	    len = (t & 0x3f) + MDLZ_MIN_LEN;
+	 if (max_size - pos < len)
+	    return -1;
+	 for (i=0; i < len; i++)
+	    put(ctx, v);
+      }else {
+	 /* match  */
+	 if (iend - ip < 2)
+	    return -1;
+	 offset = (ip[0] << 8) | ip[1];
+	 ip += 2;
+	 len = (t & 0x3f) + MDLZ_MIN_LEN;
+	 if ((offset == 0)
+	       || (offset > pos + hist)
+	       || (max_size - pos < len))
+	    return -1;
+	 for (i=0; i < len; i++)
+	    put(ctx, get(ctx, offset));
+      }
+      pos += len;
+   }
+
+   return (int)pos;
+}
@@ -19,30 +19,131 @@
 
 #include "mdproto.h"
 
+struct mdproto_link_t mdproto_link = {
+   .mtu = MDPROTO_CMD_MAX_RAW_DATA_SIZE
+};
+
+/* Nibble tables, small enough for the loader */
+static const uint16_t crc16_tbl[16] = {
+   0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+   0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+static const uint32_t crc32_tbl[16] = {
+   0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+   0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+   0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+   0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint16_t crc16(const uint8_t *p, size_t size)
+{
+   uint16_t crc = 0xffff;
+
+   while (size--) {
+      crc = (uint16_t)(crc << 4) ^ crc16_tbl[(crc >> 12) ^ (*p >> 4)];
+      crc = (uint16_t)(crc << 4) ^ crc16_tbl[(crc >> 12) ^ (*p & 0x0f)];
+      p++;
+   }
+
+   return crc;
+}
+
+/* CRC-32/IEEE 802.3. Start with crc = 0 */
+uint32_t mdproto_crc32(uint32_t crc, const void *buf, size_t size)
+{
+   const uint8_t *p = (const uint8_t *)buf;
+
+   crc = ~crc;
+   while (size--) {
+      crc = (crc >> 4) ^ crc32_tbl[(crc ^ *p) & 0x0f];
+      crc = (crc >> 4) ^ crc32_tbl[(crc ^ (*p >> 4)) & 0x0f];
+      p++;
+   }
+
+   return ~crc;
+}
+
+unsigned mdproto_fcs_size(void)
+{
+   switch (mdproto_link.fcs) {
+      case MDPROTO_FCS_CRC16:
+	 return 2;
+      case MDPROTO_FCS_CRC32:
+	 return 4;
+      default:
+	 break;
+   }
+   return 1;
+}
+
+/* Frame check sequence of size and data fields of the frame  */
+static void pkt_fcs(struct mdproto_cmd_buf_t *buf, unsigned data_size, uint8_t *dst)
+{
+   uint32_t crc;
+
+   switch (mdproto_link.fcs) {
+      case MDPROTO_FCS_CRC16:
+	 crc = crc16((const uint8_t *)buf, data_size+2);
+	 dst[0] = (uint8_t)(crc >> 8);
+	 dst[1] = (uint8_t)crc;
+	 break;
+      case MDPROTO_FCS_CRC32:
+	 crc = mdproto_crc32(0, buf, data_size+2);
+	 dst[0] = (uint8_t)(crc >> 24);
+	 dst[1] = (uint8_t)(crc >> 16);
+	 dst[2] = (uint8_t)(crc >> 8);
+	 dst[3] = (uint8_t)crc;
+	 break;
+      default:
+	 dst[0] = mdproto_pkt_csum(buf, data_size+2);
+	 break;
+   }
+}
+
 int mdproto_pkt_init(struct mdproto_cmd_buf_t *buf,
       unsigned cmd_id,
       void *raw_data,
       unsigned raw_data_size)
 {
-   unsigned data_size;
    unsigned i;
 
-   if (raw_data_size > MDPROTO_CMD_MAX_RAW_DATA_SIZE)
+   if (raw_data_size > mdproto_link.mtu)
       return -1;
 
-   /* raw_data_size + id  */
-   data_size = raw_data_size+1;
+   for (i=0; i < raw_data_size; i++)
+      buf->data.p[i+1] = ((uint8_t *)raw_data)[i];
+
+   return mdproto_pkt_finish(buf, cmd_id, raw_data_size);
+}
+
+/* Complete the frame with raw_data_size bytes of data already placed
+ * at buf->data.p[1]. Frame check is computed once over the whole frame */
+int mdproto_pkt_finish(struct mdproto_cmd_buf_t *buf,
+      unsigned cmd_id,
+      unsigned raw_data_size)
+{
+   unsigned data_size;
+   unsigned seq_size;
+
+   if (raw_data_size > mdproto_link.mtu)
+      return -1;
+
+   seq_size = mdproto_link.window ? 1 : 0;
+
+   /* raw_data_size + id + seq */
+   data_size = raw_data_size+1+seq_size;
 
    buf->data.id = cmd_id;
    buf->size = (data_size << 8) | (data_size >> 8);
 
-   for (i=0; i < raw_data_size; i++)
-      buf->data.p[i+1] = ((uint8_t *)raw_data)[i];
+   if (seq_size)
+      buf->data.p[raw_data_size+1] = mdproto_link.seq;
 
-   buf->data.p[raw_data_size+1] = mdproto_pkt_csum(buf, data_size+2);
+   pkt_fcs(buf, data_size, &buf->data.p[data_size]);
 
-   /* size, id, data, csum  */
-   return raw_data_size+4;
+   /* size, id, data, seq, fcs  */
+   return data_size+2+mdproto_fcs_size();
 }
 
 uint8_t mdproto_pkt_csum(void *buf, size_t size)
@@ -55,37 +156,30 @@ uint8_t mdproto_pkt_csum(void *buf, size_t size)
    return (uint8_t)(0 - csum);
 }
 
-int mdproto_pkt_append(struct mdproto_cmd_buf_t *buf,
-      void *data, unsigned appended_size)
+/* Verify checksum of the received frame and strip sequence number.
+ * Sequence number is available with MDPROTO_CMD_SEQ() */
+int mdproto_pkt_check(struct mdproto_cmd_buf_t *buf)
 {
    unsigned i;
-   unsigned payload_size;
-   unsigned new_size;
-   int8_t csum;
-
-   payload_size = MDPROTO_CMD_SIZE(*buf);
-   new_size = payload_size + appended_size;
-
-   if (new_size > MDPROTO_CMD_MAX_RAW_DATA_SIZE)
-      return -1;
+   unsigned size;
+   uint8_t fcs[4];
 
-   csum = (int8_t)(0 - buf->data.p[payload_size]);
-   csum -= (int8_t)((payload_size >> 8)&0xff);
-   csum -= (int8_t)(payload_size & 0xff);
-   csum += (int8_t)((new_size >> 8)&0xff);
-   csum += (int8_t)(new_size & 0xff);
+   size = MDPROTO_CMD_SIZE(*buf);
 
-   for(i=0; i<appended_size; i++) {
-      buf->data.p[payload_size+i] = ((uint8_t *)data)[i];
-      csum += ((uint8_t *)data)[i];
+   pkt_fcs(buf, size, fcs);
+   for (i=0; i < mdproto_fcs_size(); i++) {
+      if (buf->data.p[size+i] != fcs[i])
+	 return MDPROTO_STATUS_WRONG_CSUM;
    }
 
-   buf->size = (new_size << 8) | (new_size >> 8);
-   buf->data.p[new_size] = (uint8_t)(0-csum);
+   if (mdproto_link.window) {
+      /* id, seq  */
+      if (size < 2)
+	 return MDPROTO_STATUS_WRONG_PARAM;
+      size -= 1;
+      buf->size = (size << 8) | (size >> 8);
+   }
 
-   return new_size+3;
+   return MDPROTO_STATUS_OK;
 }
 
-
-
-
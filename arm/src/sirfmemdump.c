@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "mdlz.h"
 #include "mdproto.h"
 #include "sirfgps.h"
 #include "sirfgpsconf.h"
@@ -54,20 +55,48 @@ static volatile uint32_t *UNK_FFC00780 = (uint32_t *)0xFFC00780;
 
 volatile enum sirfgps_version_e gps_version;
 
+/* startup.S */
+extern const char program_version[];
+
+/* From flash_init() */
+static unsigned flash_bus_width;
+
 void wait(unsigned n);
 inline static void init2(void);
+static void mem_read_fill(uint8_t *dst, uint32_t from, unsigned size);
+static uint32_t mem_crc32(uint32_t crc, uint32_t from, unsigned size);
 
 int read_cmd(void);
 int write_cmd_response(uint8_t cmd_id, void *data, size_t data_size);
+static int param_limit(unsigned param, uint32_t *value);
+static void param_set(unsigned param, uint32_t value);
+static void hello(struct mdproto_hello_t *dst);
+
+static struct mdproto_cmd_buf_t buf __attribute__((section(".bufs")));
+
+static struct mdlz_enc_t lz_enc __attribute__((section(".bufs")));
+static uint8_t lz_buf[MDPROTO_MTU_MAX] __attribute__((section(".bufs")));
+
+/* Staging slots, slot of the running commit */
+static uint8_t stage_buf[MDPROTO_STAGE_SLOTS][MDPROTO_STAGE_SLOT_SIZE] __attribute__((section(".bufs")));
+static int commit_slot = -1;
+static int commit_res;
 
-static struct mdproto_cmd_buf_t buf;
+/* Baud rate was changed and is not confirmed yet */
+static int baud_probation;
 
 /* flash.c  */
 int flash_init(void);
 int flash_get_info(struct mdproto_cmd_flash_info_t *dst);
+uint32_t flash_get_base(void);
 int flash_16b_erase_sector(unsigned addr);
 int flash_16b_program(unsigned addr, void *buf, unsigned size);
+int flash_16b_program_lz(unsigned addr, const uint8_t *src, unsigned src_size);
+int flash_blank_check(unsigned from, unsigned size);
 int flash_change_mode(unsigned mode);
+int flash_job_start(unsigned addr, const uint8_t *src, unsigned size, int erase);
+void flash_job_poll(void);
+int flash_job_wait(void);
 
 int main(void)
 {
@@ -78,20 +107,50 @@ int main(void)
    wait(1000);
    uart1_reset();
    uart1_write("+", 1);
-   flash_init();
+   flash_bus_width = (unsigned)flash_init();
    uart1_write("++", 2);
 
+   /* Commits run while the loader waits for requests */
+   uart1_idle = flash_job_poll;
+
    status = MDPROTO_STATUS_OK;
 
    while (1) {
-      wait(1000);
-      uart1_reset();
+      /* Window mode: requests are pipelined, do not drop them */
+      if (!mdproto_link.window) {
+	 wait(1000);
+	 uart1_reset();
+      }
       status = read_cmd();
+      /* First request at the new baud rate confirms it */
+      if (baud_probation) {
+	 baud_probation = 0;
+	 if (status != MDPROTO_STATUS_OK) {
+	    uart1_restore_baud();
+	    continue;
+	 }
+      }
       if (status == MDPROTO_STATUS_OK) {
+	 /* Other commands may access the flash */
+	 if ((buf.data.id != MDPROTO_CMD_FLASH_STAGE)
+	       && (buf.data.id != MDPROTO_CMD_FLASH_COMMIT)
+	       && (commit_slot >= 0)) {
+	    if (commit_res == 0)
+	       commit_res = flash_job_wait();
+	    commit_slot = -1;
+	 }
 	 switch (buf.data.id) {
 	    case MDPROTO_CMD_PING:
 	       write_cmd_response(MDPROTO_CMD_PING_RESPONSE, "PONG", strlen("PONG"));
 	       break;
+	    case MDPROTO_CMD_HELLO:
+	       {
+		  struct mdproto_hello_t resp;
+
+		  hello(&resp);
+		  write_cmd_response(MDPROTO_CMD_HELLO_RESPONSE, (void *)&resp, sizeof(resp));
+	       }
+	       break;
 	    case MDPROTO_CMD_MEM_READ:
 	       if (MDPROTO_CMD_SIZE(buf) != 9)
 		  status = MDPROTO_STATUS_WRONG_PARAM;
@@ -109,46 +168,112 @@ int main(void)
 		  if (to < from)
 		     status = MDPROTO_STATUS_WRONG_PARAM;
 		  else {
-		     union {
-			uint32_t u32;
-			uint16_t u16[2];
-			uint8_t u8[4];
-		     } __attribute__((packed)) chunk;
-		     unsigned pkt_size, chunk_size;
-
-		     pkt_size = mdproto_pkt_init(&buf, MDPROTO_CMD_MEM_READ_RESPONSE, NULL, 0);
-
-		     /* Alligned read */
-		     while (from <= to) {
-			/* read chunk */
-			if ( ((from % 4) == 0) && ( to-from+1 >= 4 )) {
-			   uint32_t volatile *from_u32 __attribute__((aligned(__alignof__(uint32_t))));
-			   from_u32 = (uint32_t *)from;
-			   chunk_size = 4;
-			   chunk.u32 = *from_u32;
-			}else if ( ((from % 2) == 0) && ( to-from+1 >= 2 )  ) {
-			   uint16_t volatile *from_u16 __attribute__((aligned(__alignof__(uint16_t))));
-			   from_u16 = (uint16_t *)from;
-			   chunk_size = 2;
-			   chunk.u16[0] = *from_u16;
-			}else {
-			   chunk_size=1;
-			   chunk.u8[0] = *(uint8_t *)from;
-			}
-			from += chunk_size;
-
-			/* Append chunk to packet */
-			pkt_size = mdproto_pkt_append(&buf, &chunk.u8[0], chunk_size);
-
-			/* Flush full packet */
-			if (MDPROTO_CMD_SIZE(buf)+8 > MDPROTO_CMD_MAX_RAW_DATA_SIZE) {
-			   uart1_write((void *)&buf, pkt_size);
-			   pkt_size = (unsigned)mdproto_pkt_init(&buf, MDPROTO_CMD_MEM_READ_RESPONSE, NULL, 0);
-			}
-		     } /* while (from <= to) */
-
-		     if (MDPROTO_CMD_SIZE(buf) > 0)
-			uart1_write((void *)&buf, pkt_size);
+		     unsigned size;
+		     int last;
+
+		     /* One full frame at a time. to - from + 1 overflows on
+		      * the whole address space */
+		     do {
+			last = (to - from < mdproto_link.mtu);
+			size = last ? to - from + 1 : mdproto_link.mtu;
+			mem_read_fill(&buf.data.p[1], from, size);
+			from += size;
+			uart1_write((void *)&buf,
+			      mdproto_pkt_finish(&buf, MDPROTO_CMD_MEM_READ_RESPONSE, size));
+		     } while (!last);
+		  }
+	       }
+	       break;
+	    case MDPROTO_CMD_MEM_READ_LZ:
+	       if (MDPROTO_CMD_SIZE(buf) != 9)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  uint32_t from, to, start;
+		  unsigned raw_size, lz_size;
+
+		  from = (buf.data.p[1] << 24)
+		     | (buf.data.p[2] << 16)
+		     | (buf.data.p[3] << 8)
+		     | (buf.data.p[4]);
+		  to = (buf.data.p[5] << 24)
+		     | (buf.data.p[6] << 16)
+		     | (buf.data.p[7] << 8)
+		     | (buf.data.p[8]);
+
+		  if (to < from)
+		     status = MDPROTO_STATUS_WRONG_PARAM;
+		  else {
+		     start = from;
+		     mdlz_enc_init(&lz_enc);
+		     for (;;) {
+			raw_size = to - from + 1;
+			if ((raw_size == 0) || (raw_size > MDPROTO_LZ_FRAME_RAW_MAX))
+			   raw_size = MDPROTO_LZ_FRAME_RAW_MAX;
+			lz_size = mdlz_compress(&lz_enc, (const volatile uint8_t *)from, &raw_size,
+			      from - start, lz_buf, mdproto_link.mtu);
+			write_cmd_response(MDPROTO_CMD_MEM_READ_LZ_RESPONSE, lz_buf, lz_size);
+			if (to - from < raw_size)
+			   break;
+			from += raw_size;
+		     }
+		  }
+	       }
+	       break;
+	    case MDPROTO_CMD_MEM_CRC32:
+	       if (MDPROTO_CMD_SIZE(buf) != 9)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  uint32_t from, to;
+		  uint32_t crc;
+		  uint8_t res[4];
+
+		  from = (buf.data.p[1] << 24)
+		     | (buf.data.p[2] << 16)
+		     | (buf.data.p[3] << 8)
+		     | (buf.data.p[4]);
+		  to = (buf.data.p[5] << 24)
+		     | (buf.data.p[6] << 16)
+		     | (buf.data.p[7] << 8)
+		     | (buf.data.p[8]);
+
+		  if (to < from)
+		     status = MDPROTO_STATUS_WRONG_PARAM;
+		  else {
+		     /* to - from + 1 overflows for the whole address space */
+		     crc = mem_crc32(0, from, to - from);
+		     crc = mem_crc32(crc, to, 1);
+		     res[0] = (uint8_t)(crc >> 24);
+		     res[1] = (uint8_t)(crc >> 16);
+		     res[2] = (uint8_t)(crc >> 8);
+		     res[3] = (uint8_t)crc;
+		     write_cmd_response(MDPROTO_CMD_MEM_CRC32_RESPONSE, res, sizeof(res));
+		  }
+	       }
+	       break;
+	    case MDPROTO_CMD_FLASH_BLANK_CHECK:
+	       if (MDPROTO_CMD_SIZE(buf) != 9)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  uint32_t from, to;
+		  uint8_t res;
+
+		  from = (buf.data.p[1] << 24)
+		     | (buf.data.p[2] << 16)
+		     | (buf.data.p[3] << 8)
+		     | (buf.data.p[4]);
+		  to = (buf.data.p[5] << 24)
+		     | (buf.data.p[6] << 16)
+		     | (buf.data.p[7] << 8)
+		     | (buf.data.p[8]);
+
+		  if (to < from)
+		     status = MDPROTO_STATUS_WRONG_PARAM;
+		  else {
+		     /* Last byte is checked separately, as with MEM_CRC32 */
+		     res = (uint8_t)flash_blank_check(from, to - from);
+		     if ((res == 0) && (*(const volatile uint8_t *)to != 0xff))
+			res = 1;
+		     write_cmd_response(MDPROTO_CMD_FLASH_BLANK_CHECK_RESPONSE, &res, sizeof(res));
 		  }
 	       }
 	       break;
@@ -250,6 +375,116 @@ int main(void)
 		  write_cmd_response(MDPROTO_CMD_FLASH_PROGRAM_RESPONSE, (void *)&res, sizeof(res));
 	       }
 	       break;
+	    case MDPROTO_CMD_FLASH_PROGRAM_LZ:
+	       if (MDPROTO_CMD_SIZE(buf) < 4+1)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  unsigned addr;
+		  int8_t res;
+
+		  /* destination address */
+		  addr = (buf.data.p[1] << 24)
+		     | (buf.data.p[2] << 16)
+		     | (buf.data.p[3] << 8)
+		     | (buf.data.p[4]);
+
+		  res = (int8_t)flash_16b_program_lz(addr/2, &buf.data.p[5], MDPROTO_CMD_SIZE(buf)-4-1);
+		  write_cmd_response(MDPROTO_CMD_FLASH_PROGRAM_LZ_RESPONSE, (void *)&res, sizeof(res));
+	       }
+	       break;
+	    case MDPROTO_CMD_FLASH_STAGE:
+	       if (MDPROTO_CMD_SIZE(buf) < 1+1+2)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  unsigned slot, offset, size, i;
+		  int8_t res;
+
+		  slot = buf.data.p[1];
+		  offset = (buf.data.p[2] << 8) | buf.data.p[3];
+		  size = MDPROTO_CMD_SIZE(buf)-1-1-2;
+
+		  if ((slot >= MDPROTO_STAGE_SLOTS)
+			|| (offset > MDPROTO_STAGE_SLOT_SIZE)
+			|| (size > MDPROTO_STAGE_SLOT_SIZE - offset))
+		     status = MDPROTO_STATUS_WRONG_PARAM;
+		  else {
+		     if ((int)slot == commit_slot) {
+			if (commit_res == 0)
+			   commit_res = flash_job_wait();
+			commit_slot = -1;
+		     }
+		     for (i=0; i < size; i++)
+			stage_buf[slot][offset+i] = buf.data.p[4+i];
+		     res = 0;
+		     write_cmd_response(MDPROTO_CMD_FLASH_STAGE_RESPONSE, (void *)&res, sizeof(res));
+		  }
+	       }
+	       break;
+	    case MDPROTO_CMD_FLASH_COMMIT:
+	       if (MDPROTO_CMD_SIZE(buf) != 1+1+4+2+1)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  unsigned slot, addr, size, flags;
+		  int8_t res;
+
+		  slot = buf.data.p[1];
+		  addr = (buf.data.p[2] << 24)
+		     | (buf.data.p[3] << 16)
+		     | (buf.data.p[4] << 8)
+		     | (buf.data.p[5]);
+		  size = (buf.data.p[6] << 8) | buf.data.p[7];
+		  flags = buf.data.p[8];
+
+		  if ((slot >= MDPROTO_STAGE_SLOTS)
+			|| (size > MDPROTO_STAGE_SLOT_SIZE)
+			|| (size % 2))
+		     status = MDPROTO_STATUS_WRONG_PARAM;
+		  else {
+		     if ((commit_slot >= 0) && (commit_res == 0))
+			commit_res = flash_job_wait();
+		     commit_slot = -1;
+		     /* Erase starts a new sector: the error left by an
+		      * abandoned one is not reported to it */
+		     if (flags & MDPROTO_COMMIT_ERASE)
+			commit_res = 0;
+		     res = (int8_t)commit_res;
+		     commit_res = 0;
+		     write_cmd_response(MDPROTO_CMD_FLASH_COMMIT_RESPONSE, (void *)&res, sizeof(res));
+
+		     if ((res == 0) && ((size != 0) || (flags & MDPROTO_COMMIT_ERASE))) {
+			commit_slot = (int)slot;
+			flash_job_start(addr/2, stage_buf[slot], size,
+			      flags & MDPROTO_COMMIT_ERASE);
+		     }
+		  }
+	       }
+	       break;
+	    case MDPROTO_CMD_SET_PARAM:
+	       if (MDPROTO_CMD_SIZE(buf) != 1+1+4)
+		  status = MDPROTO_STATUS_WRONG_PARAM;
+	       else {
+		  unsigned param;
+		  uint32_t value;
+		  struct {
+		     int8_t res;
+		     uint32_t value;
+		  } __attribute__((packed)) resp;
+
+		  param = buf.data.p[1];
+		  value = (buf.data.p[2] << 24)
+		     | (buf.data.p[3] << 16)
+		     | (buf.data.p[4] << 8)
+		     | (buf.data.p[5]);
+
+		  resp.res = (int8_t)param_limit(param, &value);
+		  resp.value = sirfgps_htonl(value);
+		  write_cmd_response(MDPROTO_CMD_SET_PARAM_RESPONSE, (void *)&resp, sizeof(resp));
+
+		  /* New value takes effect after the response */
+		  if (resp.res == 0)
+		     param_set(param, value);
+	       }
+	       break;
 	    default:
 	       status = MDPROTO_STATUS_WRONG_CMD;
 	       break;
@@ -264,8 +499,14 @@ int read_cmd(void)
 {
    size_t cnt;
    size_t size;
-
-   cnt = uart1_read((void *)&buf.size, sizeof(buf.size));
+   int status;
+
+   if (mdproto_link.window && !baud_probation) {
+      /* Idle link is not an error in window mode */
+      while (uart1_read((void *)&buf.size, 1) == 0);
+      cnt = 1 + uart1_read((char *)&buf.size + 1, 1);
+   }else
+      cnt = uart1_read((void *)&buf.size, sizeof(buf.size));
    if (cnt < sizeof(buf.size))
       return MDPROTO_STATUS_READ_HEADER_TIMEOUT;
 
@@ -273,14 +514,93 @@ int read_cmd(void)
    if (size > sizeof(buf.data.p))
       return MDPROTO_STATUS_TOO_BIG;
 
-   cnt = uart1_read((void *)buf.data.p, size+1);
-   if (cnt < size+1)
+   cnt = uart1_read((void *)buf.data.p, size+mdproto_fcs_size());
+   if (cnt < size+mdproto_fcs_size())
       return MDPROTO_STATUS_READ_DATA_TIMEOUT;
 
-   if (buf.data.p[size] != mdproto_pkt_csum(&buf, size+2))
-      return MDPROTO_STATUS_WRONG_CSUM;
+   status = mdproto_pkt_check(&buf);
+
+   /* Responses carry sequence number of the request. NAK carries
+    * the expected one */
+   if (mdproto_link.window) {
+      if (status == MDPROTO_STATUS_OK)
+	 mdproto_link.seq = MDPROTO_CMD_SEQ(buf);
+      else
+	 mdproto_link.seq += 1;
+   }
 
-   return MDPROTO_STATUS_OK;
+   return status;
+}
+
+/* CRC-32 of memory. Read with mem_read_fill() in blocks */
+static uint32_t mem_crc32(uint32_t crc, uint32_t from, unsigned size)
+{
+   uint8_t block[64];
+   unsigned n;
+
+   while (size != 0) {
+      n = size < sizeof(block) ? size : sizeof(block);
+      mem_read_fill(block, from, n);
+      crc = mdproto_crc32(crc, block, n);
+      from += n;
+      size -= n;
+   }
+
+   return crc;
+}
+
+/*
+ * Copy memory to the frame payload. Aligned words are read with 32-bit
+ * accesses, four at a time, the unaligned head and tail with 16- and
+ * 8-bit ones. The UART is polled between bursts, so the previous frame
+ * keeps draining.
+ */
+static void mem_read_fill(uint8_t *dst, uint32_t from, unsigned size)
+{
+   const volatile uint32_t *src;
+   uint32_t w[4];
+   uint16_t h;
+   unsigned i;
+
+   while (size != 0) {
+      if (((from % 4) == 0) && (size >= 4 * 4)) {
+	 src = (const volatile uint32_t *)from;
+	 w[0] = src[0];
+	 w[1] = src[1];
+	 w[2] = src[2];
+	 w[3] = src[3];
+	 for (i=0; i < 4; i++) {
+	    dst[0] = (uint8_t)w[i];
+	    dst[1] = (uint8_t)(w[i] >> 8);
+	    dst[2] = (uint8_t)(w[i] >> 16);
+	    dst[3] = (uint8_t)(w[i] >> 24);
+	    dst += 4;
+	 }
+	 from += 4 * 4;
+	 size -= 4 * 4;
+	 uart1_poll();
+      }else if (((from % 4) == 0) && (size >= 4)) {
+	 w[0] = *(volatile uint32_t *)from;
+	 dst[0] = (uint8_t)w[0];
+	 dst[1] = (uint8_t)(w[0] >> 8);
+	 dst[2] = (uint8_t)(w[0] >> 16);
+	 dst[3] = (uint8_t)(w[0] >> 24);
+	 dst += 4;
+	 from += 4;
+	 size -= 4;
+      }else if (((from % 2) == 0) && (size >= 2)) {
+	 h = *(volatile uint16_t *)from;
+	 dst[0] = (uint8_t)h;
+	 dst[1] = (uint8_t)(h >> 8);
+	 dst += 2;
+	 from += 2;
+	 size -= 2;
+      }else {
+	 *dst++ = *(volatile uint8_t *)from;
+	 from++;
+	 size--;
+      }
+   }
 }
 
 int write_cmd_response(uint8_t cmd_id, void *data, size_t data_size)
@@ -291,8 +611,8 @@ int write_cmd_response(uint8_t cmd_id, void *data, size_t data_size)
 
    p = (uint8_t *)data;
    do {
-      if (data_size > MDPROTO_CMD_MAX_RAW_DATA_SIZE)
-	 size = MDPROTO_CMD_MAX_RAW_DATA_SIZE;
+      if (data_size > mdproto_link.mtu)
+	 size = mdproto_link.mtu;
       else
 	 size = data_size;
 
@@ -306,6 +626,102 @@ int write_cmd_response(uint8_t cmd_id, void *data, size_t data_size)
    return 1;
 }
 
+static void hello(struct mdproto_hello_t *dst)
+{
+   unsigned i;
+   uint32_t features, v;
+
+   features = MDPROTO_FEATURE_WINDOW
+      | MDPROTO_FEATURE_BAUD
+      | MDPROTO_FEATURE_FCS
+      | MDPROTO_FEATURE_MTU
+      | MDPROTO_FEATURE_MEM_READ_LZ
+      | MDPROTO_FEATURE_FLASH_PROGRAM_LZ
+      | MDPROTO_FEATURE_MEM_CRC32
+      | MDPROTO_FEATURE_FLASH_BLANK_CHECK
+      | MDPROTO_FEATURE_FLASH_STAGE
+      | MDPROTO_FEATURE_CUR_BAUD;
+
+   dst->proto_version = MDPROTO_VERSION;
+   dst->gps_version = (uint8_t)gps_version;
+   dst->flash_bus_width = (uint8_t)flash_bus_width;
+   dst->stage_slots = MDPROTO_STAGE_SLOTS;
+   dst->features = sirfgps_htonl(features);
+   /* sirfgps_htonl() evaluates the argument several times */
+   v = flash_get_base();
+   dst->flash_base = sirfgps_htonl(v);
+   v = uart1_clock();
+   dst->uart_clock = sirfgps_htonl(v);
+   dst->mtu_max = sirfgps_htons((uint16_t)MDPROTO_MTU_MAX);
+   dst->stage_slot_size = sirfgps_htons((uint16_t)MDPROTO_STAGE_SLOT_SIZE);
+
+   for (i=0; i < sizeof(dst->version); i++)
+      dst->version[i] = 0;
+   for (i=0; (i < sizeof(dst->version)-1) && (program_version[i] != 0); i++)
+      dst->version[i] = program_version[i];
+
+   flash_get_info(&dst->flash_info);
+}
+
+static int param_limit(unsigned param, uint32_t *value)
+{
+   switch (param) {
+      case MDPROTO_PARAM_WINDOW:
+	 /* Pipelined requests wait in the receive ring while the
+	  * current one is processed */
+	 if (*value > UART_RX_RING_SIZE / MDPROTO_FRAME_SIZE(mdproto_link.mtu) + 1)
+	    *value = UART_RX_RING_SIZE / MDPROTO_FRAME_SIZE(mdproto_link.mtu) + 1;
+	 break;
+      case MDPROTO_PARAM_BAUD:
+	 if (uart1_baud_div(*value) < 0)
+	    return -1;
+	 break;
+      case MDPROTO_PARAM_FCS:
+	 if (*value > MDPROTO_FCS_CRC32)
+	    return -1;
+	 break;
+      case MDPROTO_PARAM_MTU:
+	 if (*value < MDPROTO_CMD_MAX_RAW_DATA_SIZE)
+	    return -1;
+	 if (*value > MDPROTO_MTU_MAX)
+	    *value = MDPROTO_MTU_MAX;
+	 break;
+      case MDPROTO_PARAM_CUR_BAUD:
+	 if (*value == 0)
+	    return -1;
+	 break;
+      default:
+	 *value = 0;
+	 return -1;
+   }
+
+   return 0;
+}
+
+static void param_set(unsigned param, uint32_t value)
+{
+   switch (param) {
+      case MDPROTO_PARAM_WINDOW:
+	 mdproto_link.window = value;
+	 break;
+      case MDPROTO_PARAM_BAUD:
+	 uart1_set_baud(value, (unsigned)uart1_baud_div(value));
+	 baud_probation = 1;
+	 break;
+      case MDPROTO_PARAM_FCS:
+	 mdproto_link.fcs = value;
+	 break;
+      case MDPROTO_PARAM_MTU:
+	 mdproto_link.mtu = value;
+	 break;
+      case MDPROTO_PARAM_CUR_BAUD:
+	 uart1_set_rate(value);
+	 break;
+      default:
+	 break;
+   }
+}
+
 void wait(unsigned n)
 {
    static volatile unsigned i;
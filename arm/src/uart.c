@@ -33,8 +33,33 @@ volatile struct uart_t *UART_B = (struct uart_t *)0x80030010;
 
 extern volatile enum sirfgps_version_e gps_version; /* sirfmemdump.c */
 
+/* Received bytes are moved from the UART FIFO to the ring buffer by
+ * uart1_poll(), so data sent by the host while the loader is busy
+ * (flash erase / program, transmit) is not lost to FIFO overrun */
+static uint8_t rx_ring[UART_RX_RING_SIZE] __attribute__((section(".bufs")));
+static volatile unsigned rx_head, rx_tail;
+
+/* Bytes queued by uart1_write(). The hardware FIFO is filled from the
+ * ring by uart1_poll(), so the next packet is assembled while the
+ * current one is on the wire */
+static uint8_t tx_ring[UART_TX_RING_SIZE] __attribute__((section(".bufs")));
+static volatile unsigned tx_head, tx_tail;
+
+/* Called while uart1_read() waits for data */
+void (*uart1_idle)(void);
+
+/* Current and previous baud rates. uart1_rate is set by startup.S if
+ * the loader was started by the boot stub */
+unsigned uart1_rate = UART_BOOT_BAUD;
+static unsigned prev_rate;
+static uint16_t prev_div;
+
+/* sirfmemdump.c  */
+void wait(unsigned n);
+
 void uart1_reset(void)
 {
+   uart1_flush();
    if (gps_version == GPS2a) {
       *UNK_E000500C &= ~0x0180;
       *UNK_E000500C |= 0x0180;
@@ -46,25 +71,141 @@ void uart1_reset(void)
       UART_A->ctl |=  UART_CTL_RESET;
       UART_A->ctl &= ~UART_CTL_RESET;
    }
+   rx_head = rx_tail = 0;
+}
+
+static void uart1_rx_drain(void)
+{
+   while (UART_A->status & UART_STATUS_RXA_READY) {
+      /* drop byte on ring overflow */
+      if (rx_head - rx_tail >= UART_RX_RING_SIZE) {
+	 (void)UART_A->rx;
+	 continue;
+      }
+      rx_ring[rx_head++ & (UART_RX_RING_SIZE-1)] = (uint8_t)(UART_A->rx & 0xff);
+   }
+}
+
+/* Fill transmit FIFO from the ring */
+static void uart1_tx_drain(void)
+{
+   while ((tx_head != tx_tail)
+	 && !(UART_A->status & UART_STATUS_TXA_FULL)) {
+      UART_A->tx = tx_ring[tx_tail++ & (UART_TX_RING_SIZE-1)];
+   }
+}
+
+void uart1_poll(void)
+{
+   uart1_rx_drain();
+   uart1_tx_drain();
+}
+
+/* Wait until queued bytes leave the shift register */
+void uart1_flush(void)
+{
+   unsigned j, tail;
+
+   tail = tx_tail;
+   for (j=0; j<UART_TX_TIMEOUT; j++) {
+      uart1_poll();
+      if ((tx_head == tx_tail)
+	    && (UART_A->status & UART_STATUS_TXA_EMPTY))
+	 return;
+      if (tail != tx_tail) {
+	 tail = tx_tail;
+	 j = 0;
+      }
+   }
+
+   /* Stuck. Drop queued bytes */
+   tx_tail = tx_head;
+}
+
+/* UART clock derived from the current divisor. 0 if it overflows */
+unsigned uart1_clock(void)
+{
+   if ((unsigned)UART_A->baud + 1 > 0xffffffff / uart1_rate)
+      return 0;
+   return ((unsigned)UART_A->baud + 1) * uart1_rate;
 }
 
+/* Baud rate divisor for the given rate. UART clock is unknown, it is
+ * derived from the current divisor: rate = clk / (div + 1).
+ * Returns -1 if rate can not be set within UART_BAUD_TOLERANCE */
+int uart1_baud_div(unsigned rate)
+{
+   unsigned clk, div, real_rate;
+
+   if (rate == 0)
+      return -1;
+
+   clk = uart1_clock();
+   if (clk == 0)
+      return -1;
+
+   div = (clk + rate / 2) / rate;
+   if ((div == 0) || (div > 0x10000))
+      return -1;
+
+   real_rate = clk / div;
+   if (real_rate > rate) {
+      if ((real_rate - rate) * 100 > rate * UART_BAUD_TOLERANCE)
+	 return -1;
+   }else {
+      if ((rate - real_rate) * 100 > rate * UART_BAUD_TOLERANCE)
+	 return -1;
+   }
+
+   return (int)(div - 1);
+}
+
+void uart1_set_baud(unsigned rate, unsigned div)
+{
+   /* Let the last byte leave the shift register */
+   uart1_flush();
+   wait(10000);
+
+   prev_rate = uart1_rate;
+   prev_div = UART_A->baud;
+
+   UART_A->baud = (uint16_t)div;
+   uart1_rate = rate;
+   rx_head = rx_tail = 0;
+}
+
+/* UART runs at the rate with the current divisor */
+void uart1_set_rate(unsigned rate)
+{
+   uart1_rate = rate;
+}
+
+/* Return to the baud rate used before the last uart1_set_baud() */
+void uart1_restore_baud(void)
+{
+   if (prev_rate == 0)
+      return;
+   uart1_set_baud(prev_rate, prev_div);
+}
+
+/* Queue bytes for transmission. Waits only while the ring is full */
 ssize_t uart1_write(const char *src, size_t size)
 {
    size_t send;
    unsigned j;
 
-   send = 0;
-   for(;;) {
-      if (send >= size)
-	 break;
-      for (j=0; j<1000; j++) {
-	 if (UART_A->status & UART_STATUS_TXA_EMPTY)
-	    break;
+   for (send = 0; send < size; send++) {
+      for (j=0; tx_head - tx_tail >= UART_TX_RING_SIZE; j++) {
+	 if (j == UART_TX_TIMEOUT)
+	    return (ssize_t)send;
+	 uart1_poll();
       }
-      UART_A->tx = *src++;
-      send++;
+      tx_ring[tx_head & (UART_TX_RING_SIZE-1)] = (uint8_t)*src++;
+      tx_head++;
    }
 
+   uart1_tx_drain();
+
    return (ssize_t)send;
 }
 
@@ -76,9 +217,13 @@ ssize_t uart1_read(char *dst, size_t size)
    rcvd = 0;
    tmout = UART_READ_TIMEOUT;
    while (tmout--) {
-      if (!(UART_A->status & UART_STATUS_RXA_READY))
+      uart1_poll();
+      if (rx_head == rx_tail) {
+	 if (uart1_idle)
+	    uart1_idle();
 	 continue;
-      *dst++ = (char)(UART_A->rx & 0xff);
+      }
+      *dst++ = (char)rx_ring[rx_tail++ & (UART_RX_RING_SIZE-1)];
       if (++rcvd >= (ssize_t)size)
 	 break;
       tmout = UART_READ_TIMEOUT;
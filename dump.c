@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "flashutils.h"
+#include "arm/include/mdlz.h"
+#include "arm/include/mdproto.h"
+
+
+/* Size of MEM_READ_LZ requests and stop-and-wait MEM_READ requests.
+ * Matches do not cross requests, so it should not be too small. On error
+ * the rest of the response is drained, so it should not be too large */
+#define DUMP_LONG_CHUNK_SIZE 16384
+
+/* Number of retries without progress */
+#define DUMP_MAX_RETRIES 8
+
+/* Error recovery: the line is drained until it is quiet for
+ * DUMP_DRAIN_QUIET ms, but no longer than DUMP_DRAIN_MAX ms */
+#define DUMP_DRAIN_QUIET 200
+#define DUMP_DRAIN_MAX 30000
+
+/* Loader supports MDPROTO_CMD_MEM_READ_LZ */
+static int dump_lz;
+
+/* MEM_READ_LZ decoder history */
+static struct {
+   uint8_t buf[MDLZ_MAX_OFFSET+MDPROTO_LZ_FRAME_RAW_MAX];
+   unsigned pos;
+} lz_hist;
+
+static void lz_hist_put(void *ctx, uint8_t b)
+{
+  (void)ctx;
+  lz_hist.buf[lz_hist.pos++] = b;
+}
+
+static uint8_t lz_hist_get(void *ctx, unsigned offset)
+{
+  (void)ctx;
+  return lz_hist.buf[lz_hist.pos - offset];
+}
+
+static int send_mem_read(int pfd, unsigned cmd_id, unsigned src_addr, unsigned dst_addr)
+{
+  int write_size;
+  struct mdproto_cmd_buf_t cmd;
+  struct {
+     uint32_t src;
+     uint32_t dst;
+  } __attribute__((packed)) req;
+
+  req.src = htonl(src_addr);
+  req.dst = htonl(dst_addr);
+  write_size = mdproto_pkt_init(&cmd, cmd_id, &req, sizeof(req));
+
+  if (write(pfd, (void *)&cmd, write_size) < write_size) {
+     gpsd_report(LOG_PROG, "write() error\n");
+     return -1;
+  }
+  mdproto_link.seq++;
+
+  return 0;
+}
+
+/*
+ * Check if loader supports compressed reads. Old loaders reply with
+ * MDPROTO_STATUS_WRONG_CMD. No request if the loader said hello
+ */
+int dump_lz_probe(int pfd)
+{
+  unsigned read_status;
+  struct mdproto_cmd_buf_t cmd;
+
+  dump_lz = 0;
+  if (loader_info.valid)
+     dump_lz = (loader_info.hello.features & MDPROTO_FEATURE_MEM_READ_LZ) != 0;
+  else {
+     serialFlush(pfd);
+     if (send_mem_read(pfd, MDPROTO_CMD_MEM_READ_LZ, 0, 0) != 0)
+	return 0;
+
+     read_status = read_mdproto_pkt(pfd, &cmd);
+     if ((read_status == MDPROTO_STATUS_OK)
+	   && (cmd.data.id == MDPROTO_CMD_MEM_READ_LZ_RESPONSE))
+	dump_lz = 1;
+  }
+
+  gpsd_report(LOG_PROG, "compressed reads %s\n", dump_lz ? "enabled" : "not supported");
+  return dump_lz;
+}
+
+/*
+ * CRC-32 of memory [src_addr, dst_addr] computed by the loader.
+ * Returns -1 on error or if the loader does not support MDPROTO_CMD_MEM_CRC32
+ */
+int dump_mem_crc32(int pfd, unsigned src_addr, unsigned dst_addr, uint32_t *crc)
+{
+  unsigned read_status;
+  struct mdproto_cmd_buf_t cmd;
+
+  serialFlush(pfd);
+  if (send_mem_read(pfd, MDPROTO_CMD_MEM_CRC32, src_addr, dst_addr) != 0)
+     return -1;
+
+  read_status = read_mdproto_pkt(pfd, &cmd);
+  if (read_status != MDPROTO_STATUS_OK) {
+     gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+     return -1;
+  }
+
+  if ((cmd.data.id != MDPROTO_CMD_MEM_CRC32_RESPONSE)
+	|| (MDPROTO_CMD_SIZE(cmd) != 1+4)) {
+     gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+     return -1;
+  }
+
+  *crc = ((uint32_t)cmd.data.p[1] << 24)
+     | ((uint32_t)cmd.data.p[2] << 16)
+     | ((uint32_t)cmd.data.p[3] << 8)
+     | cmd.data.p[4];
+
+  return 0;
+}
+
+/*
+ * Read memory [src_addr, dst_addr] and pass received data to sink().
+ *
+ * In window mode the range is split into mdproto_link.mtu byte requests,
+ * each answered with one MEM_READ_RESPONSE frame. Up to
+ * mdproto_link.window requests are kept in flight, so the loader always has
+ * the next request in its receive ring. Without window mode the range
+ * is read with DUMP_LONG_CHUNK_SIZE requests one by one.
+ *
+ * MEM_READ_LZ is used if the loader supports it.
+ *
+ * Data is passed to sink() in order. On error the line is drained and
+ * only the data not received yet is requested again.
+ */
+int dump_mem_range(int pfd, unsigned src_addr, unsigned dst_addr,
+      dump_sink_t sink, void *ctx)
+{
+  unsigned read_status;
+  unsigned cur_size;
+  unsigned credits, in_flight;
+  unsigned req_addr, req_last;
+  unsigned rcv_addr;
+  unsigned chunk_size;
+  unsigned cmd_id, resp_id;
+  int req_done;
+  int req_first;
+  int lz_size;
+  unsigned retries;
+  const uint8_t *data;
+  uint8_t seq;
+  unsigned inflight_last[256];
+  struct mdproto_cmd_buf_t cmd;
+
+  credits = mdproto_link.window ? mdproto_link.window : 1;
+  in_flight = 0;
+  req_done = 0;
+  req_addr = rcv_addr = src_addr;
+  seq = mdproto_link.seq;
+  req_first = 1;
+  retries = 0;
+
+  if (dump_lz) {
+     cmd_id = MDPROTO_CMD_MEM_READ_LZ;
+     resp_id = MDPROTO_CMD_MEM_READ_LZ_RESPONSE;
+     chunk_size = DUMP_LONG_CHUNK_SIZE;
+  }else {
+     cmd_id = MDPROTO_CMD_MEM_READ;
+     resp_id = MDPROTO_CMD_MEM_READ_RESPONSE;
+     chunk_size = mdproto_link.window ? mdproto_link.mtu : DUMP_LONG_CHUNK_SIZE;
+  }
+
+  serialFlush(pfd);
+
+  for (;;) {
+     /* Fill the window */
+     while (!req_done && (in_flight < credits)) {
+	req_last = req_addr + chunk_size - 1;
+	if ((req_last < req_addr) || (req_last > dst_addr))
+	   req_last = dst_addr;
+
+	inflight_last[mdproto_link.seq] = req_last;
+	if (send_mem_read(pfd, cmd_id, req_addr, req_last) != 0)
+	   return 1;
+	in_flight++;
+
+	if (req_last == dst_addr)
+	   req_done = 1;
+	else
+	   req_addr = req_last + 1;
+     }
+
+     if (in_flight == 0)
+	break;
+
+     gpsd_report(LOG_RAW, "0x%x...\n", rcv_addr);
+     read_status = read_mdproto_pkt(pfd, &cmd);
+     if (read_status != MDPROTO_STATUS_OK) {
+	gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c` at 0x%x\n", read_status, rcv_addr);
+	goto retry;
+     }
+     if (cmd.data.id != resp_id) {
+	gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+	goto retry;
+     }
+     if (mdproto_link.window && (MDPROTO_CMD_SEQ(cmd) != seq)) {
+	/* Late response to a request sent before the last retry */
+	if ((uint8_t)(seq - MDPROTO_CMD_SEQ(cmd)) < 128)
+	   continue;
+	gpsd_report(LOG_PROG, "received response %u, expected %u\n",
+	      (unsigned)MDPROTO_CMD_SEQ(cmd), (unsigned)seq);
+	goto retry;
+     }
+
+     if (dump_lz) {
+	if (req_first)
+	   lz_hist.pos = 0;
+	else if (lz_hist.pos > MDLZ_MAX_OFFSET) {
+	   memmove(lz_hist.buf, &lz_hist.buf[lz_hist.pos-MDLZ_MAX_OFFSET], MDLZ_MAX_OFFSET);
+	   lz_hist.pos = MDLZ_MAX_OFFSET;
+	}
+	data = &lz_hist.buf[lz_hist.pos];
+	lz_size = mdlz_decode(&cmd.data.p[1], MDPROTO_CMD_SIZE(cmd) - 1,
+	      MDPROTO_LZ_FRAME_RAW_MAX, lz_hist.pos, lz_hist_put, lz_hist_get, NULL);
+	if ((lz_size < 0) || ((unsigned)lz_size > inflight_last[seq] - rcv_addr + 1)) {
+	   gpsd_report(LOG_PROG, "broken compressed data at 0x%x\n", rcv_addr);
+	   goto retry;
+	}
+	cur_size = (unsigned)lz_size;
+     }else {
+	data = &cmd.data.p[1];
+	cur_size = MDPROTO_CMD_SIZE(cmd) - 1;
+	if (cur_size > inflight_last[seq] - rcv_addr + 1)
+	   cur_size = inflight_last[seq] - rcv_addr + 1;
+     }
+     if (cur_size == 0)
+	continue;
+     req_first = 0;
+     retries = 0;
+
+     if (sink(ctx, rcv_addr, data, cur_size) != 0)
+	return 1;
+
+     /* Request completed */
+     if (rcv_addr + cur_size - 1 == inflight_last[seq]) {
+	in_flight--;
+	seq++;
+	req_first = 1;
+     }
+     rcv_addr += cur_size;
+     continue;
+
+retry:
+     if (++retries > DUMP_MAX_RETRIES) {
+	gpsd_report(LOG_PROG, "too many errors at 0x%x\n", rcv_addr);
+	return 1;
+     }
+     gpsd_report(LOG_PROG, "retry %u from 0x%x\n", retries, rcv_addr);
+     serialDrain(pfd, DUMP_DRAIN_QUIET, DUMP_DRAIN_MAX);
+     req_addr = rcv_addr;
+     req_done = 0;
+     in_flight = 0;
+     req_first = 1;
+     seq = mdproto_link.seq;
+  }
+
+  return 0;
+}
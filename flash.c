@@ -29,11 +29,12 @@
 #include <unistd.h>
 
 #include "flashutils.h"
+#include "arm/include/mdlz.h"
 #include "arm/include/mdproto.h"
 
 #define FLASH_MAX_ERASE_BLOCK_NUM 10
 
-/* XXX */
+/* Flash base address of loaders without MDPROTO_CMD_HELLO */
 #define EXT_SRAM_CSN0 0x40000000
 
 struct flash_erase_block_t {
@@ -68,7 +69,15 @@ static struct flash_erase_block_t *flash_eblock_by_idx(struct flash_erase_block_
 static struct flash_erase_block_t *flash_eblock_by_addr(struct flash_erase_block_t *map, unsigned addr);
 
 static int dump_mem(int pfd, unsigned src_addr, unsigned size, uint8_t *res);
-static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_size);
+static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_size,
+      const uint8_t *old);
+
+/* Loader supports MDPROTO_CMD_FLASH_PROGRAM_LZ */
+static int flash_lz;
+static struct mdlz_enc_t lz_enc;
+
+/* Loader supports MDPROTO_CMD_FLASH_STAGE / MDPROTO_CMD_FLASH_COMMIT */
+static int flash_stage;
 
 
 void flash_get_name(unsigned manufacturer_id, unsigned device_id,
@@ -317,16 +326,46 @@ int dump_flash_info(const struct mdproto_cmd_flash_info_t *data)
    return 1;
 }
 
+static const char *flash_strerror(int res)
+{
+  switch (res) {
+     case MDPROTO_FLASH_ERR_TIMEOUT:
+	return "timeout";
+     case MDPROTO_FLASH_ERR_VERIFY:
+	return "verify error";
+     case MDPROTO_FLASH_ERR_DATA:
+	return "broken data";
+     case MDPROTO_FLASH_ERR_DEVICE:
+	return "device error";
+     default:
+	break;
+  }
+  return "unknown error";
+}
+
+static unsigned flash_base(void)
+{
+  if (loader_info.valid && (loader_info.hello.flash_base != 0))
+     return loader_info.hello.flash_base;
+  return EXT_SRAM_CSN0;
+}
+
 static int get_flash_info(int pfd, struct mdproto_cmd_flash_info_t *res)
 {
   int write_size;
   unsigned read_status;
   struct mdproto_cmd_buf_t cmd;
 
+  /* Sent with HELLO */
+  if (loader_info.valid) {
+     memcpy(res, &loader_info.hello.flash_info, sizeof(*res));
+     return 0;
+  }
+
   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_INFO, NULL, 0);
   gpsd_report(LOG_PROG, "FLASH-INFO...\n");
 
-  tcflush(pfd, TCIOFLUSH);
+  serialFlush(pfd);
   usleep(10000);
   if (write(pfd, (void *)&cmd, write_size) < write_size) {
      gpsd_report(LOG_PROG, "write() error\n");
@@ -354,49 +393,29 @@ static int get_flash_info(int pfd, struct mdproto_cmd_flash_info_t *res)
   return 0;
 }
 
-static int dump_mem(int pfd, unsigned src_addr, unsigned size, uint8_t *res)
+struct dump_mem_ctx_t {
+   unsigned src_addr;
+   uint8_t *res;
+};
+
+static int dump_to_mem(void *ctx, unsigned addr, const uint8_t *data, unsigned size)
 {
-  unsigned read_status;
-  int write_size;
-  int cur_size;
-  unsigned dst_addr;
-  struct mdproto_cmd_buf_t cmd;
-  struct {
-     uint32_t src;
-     uint32_t dst;
-  } __attribute__((packed)) req;
+  struct dump_mem_ctx_t *c;
 
+  c = (struct dump_mem_ctx_t *)ctx;
+  memcpy(&c->res[addr - c->src_addr], data, size);
 
-  dst_addr = src_addr+size-1;
-  req.src = htonl(src_addr);
-  req.dst = htonl(dst_addr);
-  write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_MEM_READ, &req, sizeof(req));
+  return 0;
+}
 
-  tcflush(pfd, TCIOFLUSH);
-  if (write(pfd, (void *)&cmd, write_size) < write_size) {
-     gpsd_report(LOG_PROG, "write() error\n");
-     return 1;
-  }
+static int dump_mem(int pfd, unsigned src_addr, unsigned size, uint8_t *res)
+{
+  struct dump_mem_ctx_t ctx;
 
-  while (src_addr <= dst_addr) {
-     read_status = read_mdproto_pkt(pfd, &cmd);
-     if (read_status != MDPROTO_STATUS_OK) {
-	gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
-	return 1;
-     }
-     if (cmd.data.id != MDPROTO_CMD_MEM_READ_RESPONSE) {
-	gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
-	return 1;
-     }
-     cur_size = ntohs(cmd.size) - 1;
-     if (src_addr+cur_size > dst_addr)
-	cur_size = dst_addr - src_addr + 1;
-     memcpy(res, &cmd.data.p[1], cur_size);
-     res += cur_size;
-     src_addr += cur_size;
-  }
+  ctx.src_addr = src_addr;
+  ctx.res = res;
 
-  return 0;
+  return dump_mem_range(pfd, src_addr, src_addr+size-1, dump_to_mem, &ctx);
 }
 
 
@@ -424,7 +443,7 @@ int cmd_erase_sector(int pfd, unsigned addr)
   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_ERASE_SECTOR, &addr_ui32, sizeof(addr_ui32));
   gpsd_report(LOG_PROG, "FLASH-ERASE 0x%x...\n", addr);
 
-  tcflush(pfd, TCIOFLUSH);
+  serialFlush(pfd);
   if (write(pfd, (void *)&cmd, write_size) < write_size) {
      gpsd_report(LOG_PROG, "write() error\n");
      return 1;
@@ -450,65 +469,388 @@ int cmd_erase_sector(int pfd, unsigned addr)
   if (res==0) {
      gpsd_report(LOG_PROG, "OK\n");
   }else {
-     gpsd_report(LOG_PROG, "error %i\n", (int)res);
+     gpsd_report(LOG_PROG, "error %i (%s)\n", (int)res, flash_strerror(res));
   }
 
   return (int)res;
 }
 
-static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_size)
+/*
+ * Check if the sector is erased. Returns 1 if blank, 0 if not, -1 on error
+ * or if the loader does not support MDPROTO_CMD_FLASH_BLANK_CHECK
+ */
+static int blank_check(int pfd, unsigned addr, unsigned size)
+{
+  int write_size;
+  unsigned read_status;
+  struct {
+     uint32_t src;
+     uint32_t dst;
+  } __packed req;
+  struct mdproto_cmd_buf_t cmd;
+
+  req.src = htonl(flash_base()+addr);
+  req.dst = htonl(flash_base()+addr+size-1);
+  write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_BLANK_CHECK, &req, sizeof(req));
+
+  serialFlush(pfd);
+  if (write(pfd, (void *)&cmd, write_size) < write_size) {
+     gpsd_report(LOG_PROG, "write() error\n");
+     return -1;
+  }
+  mdproto_link.seq++;
+
+  read_status = read_mdproto_pkt(pfd, &cmd);
+  if (read_status != MDPROTO_STATUS_OK) {
+     gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+     return -1;
+  }
+
+  if ((cmd.data.id != MDPROTO_CMD_FLASH_BLANK_CHECK_RESPONSE)
+	|| (ntohs(cmd.size) != 1+1)) {
+     gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+     return -1;
+  }
+
+  return cmd.data.p[1] == 0;
+}
+
+/*
+ * Check if loader supports compressed programming. Empty block does not
+ * touch the flash. Old loaders reply with MDPROTO_STATUS_WRONG_CMD
+ */
+int flash_lz_probe(int pfd)
+{
+  int write_size;
+  int read_status;
+  uint32_t addr;
+  struct mdproto_cmd_buf_t cmd;
+
+  flash_lz = 0;
+  if (loader_info.valid)
+     flash_lz = (loader_info.hello.features & MDPROTO_FEATURE_FLASH_PROGRAM_LZ) != 0;
+  else {
+     addr = 0;
+     write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_PROGRAM_LZ, &addr, sizeof(addr));
+
+     serialFlush(pfd);
+     if (write(pfd, (void *)&cmd, write_size) < write_size) {
+	gpsd_report(LOG_PROG, "write() error\n");
+	return 0;
+     }
+     mdproto_link.seq++;
+
+     read_status = read_mdproto_pkt(pfd, &cmd);
+     if ((read_status == MDPROTO_STATUS_OK)
+	   && (cmd.data.id == MDPROTO_CMD_FLASH_PROGRAM_LZ_RESPONSE))
+	flash_lz = 1;
+  }
+
+  gpsd_report(LOG_PROG, "compressed programming %s\n", flash_lz ? "enabled" : "not supported");
+  return flash_lz;
+}
+
+/* New data can be programmed without erase if it only clears bits */
+static int clears_bits_only(const uint8_t *old, const uint8_t *data, unsigned size)
+{
+  unsigned i;
+
+  for (i = 0; i < size; i++)
+     if ((old[i] & data[i]) != data[i])
+	return 0;
+  return 1;
+}
+
+/*
+ * Check if loader supports staged programming. Empty commit does not
+ * touch the flash
+ */
+static int flash_stage_probe(int pfd)
 {
-  int res;
   int write_size;
   int read_status;
-  unsigned chunk_size;
   struct {
+     uint8_t slot;
      uint32_t addr;
-     uint8_t payload[MDPROTO_CMD_MAX_RAW_DATA_SIZE-4];
-  } __packed t_req;
+     uint16_t size;
+     uint8_t flags;
+  } __packed req;
   struct mdproto_cmd_buf_t cmd;
 
-  assert((sizeof(t_req.payload) % 4) == 0);
-  assert(sizeof(t_req.payload) >= 4);
+  flash_stage = 0;
+  if (loader_info.valid) {
+     flash_stage = (loader_info.hello.features & MDPROTO_FEATURE_FLASH_STAGE) != 0;
+     return flash_stage;
+  }
 
-  res = cmd_erase_sector(pfd, addr);
-  if (res != 0)
-     return res;
+  memset(&req, 0, sizeof(req));
+  write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_COMMIT, &req, sizeof(req));
+
+  serialFlush(pfd);
+  if (write(pfd, (void *)&cmd, write_size) < write_size) {
+     gpsd_report(LOG_PROG, "write() error\n");
+     return 0;
+  }
+  mdproto_link.seq++;
 
-  while (data_size != 0) {
+  read_status = read_mdproto_pkt(pfd, &cmd);
+  if ((read_status == MDPROTO_STATUS_OK)
+	&& (cmd.data.id == MDPROTO_CMD_FLASH_COMMIT_RESPONSE))
+     flash_stage = 1;
+
+  gpsd_report(LOG_PROG, "staged programming %s\n", flash_stage ? "enabled" : "not supported");
+  return flash_stage;
+}
 
-     t_req.addr = ntohl((uint32_t)addr);
+static int is_blank(const uint8_t *data, unsigned size)
+{
+  unsigned i;
 
-     if (data_size >= sizeof(t_req.payload)) {
-	chunk_size = sizeof(t_req.payload);
-	memcpy(t_req.payload, data, chunk_size);
-	gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes\n", addr, chunk_size);
+  for (i = 0; i < size; i++)
+     if (data[i] != 0xff)
+	return 0;
+  return 1;
+}
 
-	write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_PROGRAM,
-	      &t_req, sizeof(t_req));
-	data_size -= chunk_size;
-	addr += chunk_size;
-	data += chunk_size;
-     }else {
-	chunk_size = data_size;
-	memcpy(t_req.payload, data, chunk_size);
-	gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes\n", addr, chunk_size);
+/*
+ * Erase and program sector through the loader staging slots. The loader
+ * erases the sector and programs one slot while the next one is being
+ * transferred. Blank slots after the erase are not sent.
+ */
+static int program_sector_staged(int pfd, unsigned addr, const uint8_t *data, unsigned data_size)
+{
+  int res;
+  int write_size;
+  int read_status;
+  int done;
+  unsigned pos, offset, slot, slot_size, flags;
+  unsigned chunk_size;
+  unsigned credits, in_flight;
+  uint8_t seq;
+  struct {
+     uint8_t slot;
+     uint16_t offset;
+     uint8_t payload[MDPROTO_MTU_MAX-3];
+  } __packed s_req;
+  struct {
+     uint8_t slot;
+     uint32_t addr;
+     uint16_t size;
+     uint8_t flags;
+  } __packed c_req;
+  struct mdproto_cmd_buf_t cmd;
 
-	addr += chunk_size;
-	data_size = 0;
+  credits = mdproto_link.window ? mdproto_link.window : 1;
+  in_flight = 0;
+  seq = mdproto_link.seq;
+
+  pos = offset = 0;
+  slot = 0;
+  flags = MDPROTO_COMMIT_ERASE;
+  done = 0;
+
+  while (!done || (in_flight != 0)) {
+
+     while (!done && (in_flight < credits)) {
+	slot_size = data_size - pos;
+	if (slot_size > MDPROTO_STAGE_SLOT_SIZE)
+	   slot_size = MDPROTO_STAGE_SLOT_SIZE;
+
+	if ((flags == 0) && (offset == 0) && (slot_size != 0)
+	      && is_blank(&data[pos], slot_size)) {
+	   pos += slot_size;
+	   continue;
+	}
+
+	if (slot_size == 0) {
+	   /* Wait for the last commit */
+	   memset(&c_req, 0, sizeof(c_req));
+	   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_COMMIT, &c_req, sizeof(c_req));
+	   done = 1;
+	}else if (offset < slot_size) {
+	   chunk_size = slot_size - offset;
+	   if (chunk_size > mdproto_link.mtu - 3)
+	      chunk_size = mdproto_link.mtu - 3;
+	   s_req.slot = slot;
+	   s_req.offset = htons((uint16_t)offset);
+	   memcpy(s_req.payload, &data[pos+offset], chunk_size);
+	   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_STAGE, &s_req, chunk_size+3);
+	   offset += chunk_size;
+	}else {
+	   gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes (staged)\n", addr+pos, slot_size);
+	   c_req.slot = slot;
+	   c_req.addr = htonl(addr+pos);
+	   c_req.size = htons((uint16_t)slot_size);
+	   c_req.flags = flags;
+	   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_COMMIT, &c_req, sizeof(c_req));
+	   pos += slot_size;
+	   offset = 0;
+	   flags = 0;
+	   slot = (slot + 1) % MDPROTO_STAGE_SLOTS;
+	}
+
+	if (!mdproto_link.window)
+	   serialFlush(pfd);
+	if (write(pfd, (void *)&cmd, write_size) < write_size) {
+	   gpsd_report(LOG_PROG, "write() error\n");
+	   return 1;
+	}
+	mdproto_link.seq++;
+	in_flight++;
+     }
+
+     read_status = read_mdproto_pkt(pfd, &cmd);
+     if (read_status != MDPROTO_STATUS_OK) {
+	gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+	return 1;
+     }
 
-	if (chunk_size % 2)
-	   t_req.payload[chunk_size++] = 0xff;
-	write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_FLASH_PROGRAM,
-	      &t_req, chunk_size+4);
+     if ((cmd.data.id != MDPROTO_CMD_FLASH_STAGE_RESPONSE)
+	   && (cmd.data.id != MDPROTO_CMD_FLASH_COMMIT_RESPONSE)) {
+	gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+	return 1;
      }
 
+     if (ntohs(cmd.size) != 1+1) {
+	gpsd_report(LOG_PROG, "received wrong response size `0x%x`\n", ntohs(cmd.size));
+	return 1;
+     }
 
-     tcflush(pfd, TCIOFLUSH);
-     if (write(pfd, (void *)&cmd, write_size) < write_size) {
-	gpsd_report(LOG_PROG, "write() error\n");
+     if (mdproto_link.window && (MDPROTO_CMD_SEQ(cmd) != seq)) {
+	gpsd_report(LOG_PROG, "received response %u, expected %u\n",
+	      (unsigned)MDPROTO_CMD_SEQ(cmd), (unsigned)seq);
+	return 1;
+     }
+     seq++;
+     in_flight--;
+
+     res = (int8_t)cmd.data.p[1];
+     if (res != 0) {
+	gpsd_report(LOG_PROG, "error %i (%s)\n", res, flash_strerror(res));
 	return 1;
      }
+  }
+
+  return 0;
+}
+
+/*
+ * Program sector. If old contents of the sector are given, the sector is
+ * not erased and only changed words are sent.
+ */
+static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_size,
+      const uint8_t *old)
+{
+  int res;
+  int write_size;
+  int read_status;
+  unsigned chunk_size, lz_size;
+  unsigned credits, in_flight;
+  unsigned cmd_id, resp_id;
+  unsigned room;
+  uint8_t seq;
+  uint8_t *sector_data;
+  struct {
+     uint32_t addr;
+     uint8_t payload[MDPROTO_MTU_MAX-4];
+  } __packed t_req;
+  struct mdproto_cmd_buf_t cmd;
+
+  /* Data in a frame, whole words */
+  room = (mdproto_link.mtu - 4) & ~3u;
+  assert(room >= 4);
+  assert(room <= sizeof(t_req.payload));
+
+  if (old == NULL) {
+     res = cmd_erase_sector(pfd, addr);
+     if (res != 0)
+	return res;
+  }
+
+  if (flash_lz) {
+     cmd_id = MDPROTO_CMD_FLASH_PROGRAM_LZ;
+     resp_id = MDPROTO_CMD_FLASH_PROGRAM_LZ_RESPONSE;
+     mdlz_enc_init(&lz_enc);
+  }else {
+     cmd_id = MDPROTO_CMD_FLASH_PROGRAM;
+     resp_id = MDPROTO_CMD_FLASH_PROGRAM_RESPONSE;
+  }
+  sector_data = data;
+
+  /* Window mode: keep up to `credits` chunks in flight */
+  credits = mdproto_link.window ? mdproto_link.window : 1;
+  in_flight = 0;
+  seq = mdproto_link.seq;
+
+  while ((data_size != 0) || (in_flight != 0)) {
+
+     while ((data_size != 0) && (in_flight < credits)) {
+	/* Skip unchanged words */
+	if (old != NULL) {
+	   while ((data_size >= 2)
+		 && (memcmp(data, &old[data - sector_data], 2) == 0)) {
+	      data += 2;
+	      addr += 2;
+	      data_size -= 2;
+	   }
+	   if (data_size == 0)
+	      break;
+	}
+	t_req.addr = ntohl((uint32_t)addr);
+
+	if (flash_lz) {
+	   /* Matches refer to the already programmed part of the sector.
+	    * Next chunk must start at word boundary */
+	   chunk_size = data_size;
+	   for (;;) {
+	      lz_size = mdlz_compress(&lz_enc, data, &chunk_size,
+		    (unsigned)(data - sector_data), t_req.payload, room);
+	      if (((chunk_size % 2) == 0) || (chunk_size == data_size))
+		 break;
+	      chunk_size--;
+	   }
+	   gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes (%u compressed)\n",
+		 addr, chunk_size, lz_size);
+	   write_size = mdproto_pkt_init(&cmd, cmd_id, &t_req, lz_size+4);
+	   data_size -= chunk_size;
+	   addr += chunk_size;
+	   data += chunk_size;
+	}else if (data_size >= room) {
+	   chunk_size = room;
+	   memcpy(t_req.payload, data, chunk_size);
+	   gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes\n", addr, chunk_size);
+
+	   write_size = mdproto_pkt_init(&cmd, cmd_id,
+		 &t_req, chunk_size+4);
+	   data_size -= chunk_size;
+	   addr += chunk_size;
+	   data += chunk_size;
+	}else {
+	   chunk_size = data_size;
+	   memcpy(t_req.payload, data, chunk_size);
+	   gpsd_report(LOG_PROG, "programming 0x%08x: %u bytes\n", addr, chunk_size);
+
+	   addr += chunk_size;
+	   data_size = 0;
+
+	   if (chunk_size % 2)
+	      t_req.payload[chunk_size++] = 0xff;
+	   write_size = mdproto_pkt_init(&cmd, cmd_id,
+		 &t_req, chunk_size+4);
+	}
+
+	if (!mdproto_link.window)
+	   serialFlush(pfd);
+	if (write(pfd, (void *)&cmd, write_size) < write_size) {
+	   gpsd_report(LOG_PROG, "write() error\n");
+	   return 1;
+	}
+	mdproto_link.seq++;
+	in_flight++;
+     }
+
+     if (in_flight == 0)
+	break;
 
      read_status = read_mdproto_pkt(pfd, &cmd);
      if (read_status != MDPROTO_STATUS_OK) {
@@ -516,7 +858,7 @@ static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_s
 	return 1;
      }
 
-     if (cmd.data.id != MDPROTO_CMD_FLASH_PROGRAM_RESPONSE) {
+     if (cmd.data.id != resp_id) {
 	gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
 	return 1;
      }
@@ -526,9 +868,17 @@ static int program_sector(int pfd, unsigned addr, uint8_t *data, unsigned data_s
 	return 1;
      }
 
+     if (mdproto_link.window && (MDPROTO_CMD_SEQ(cmd) != seq)) {
+	gpsd_report(LOG_PROG, "received response %u, expected %u\n",
+	      (unsigned)MDPROTO_CMD_SEQ(cmd), (unsigned)seq);
+	return 1;
+     }
+     seq++;
+     in_flight--;
+
      res = (int8_t)cmd.data.p[1];
      if (res != 0) {
-	gpsd_report(LOG_PROG, "error %i\n", (int)res);
+	gpsd_report(LOG_PROG, "error %i (%s)\n", (int)res, flash_strerror(res));
 	return 1;
      }
   }
@@ -556,7 +906,7 @@ int cmd_program_word(int pfd, unsigned addr, uint16_t word)
    &t_req, sizeof(t_req));
 
   usleep(10000);
-  tcflush(pfd, TCIOFLUSH);
+  serialFlush(pfd);
   if (write(pfd, (void *)&cmd, write_size) < write_size) {
      gpsd_report(LOG_PROG, "write() error\n");
      return 1;
@@ -582,7 +932,7 @@ int cmd_program_word(int pfd, unsigned addr, uint16_t word)
   if (res==0) {
      gpsd_report(LOG_PROG, "OK\n");
   }else {
-     gpsd_report(LOG_PROG, "error %i\n", (int)res);
+     gpsd_report(LOG_PROG, "error %i (%s)\n", (int)res, flash_strerror(res));
   }
 
   return (int)res;
@@ -593,6 +943,9 @@ int cmd_program_flash(int pfd, const char *prom_fname)
 {
   int res;
   int prom_fd;
+  int use_crc, use_blank_check;
+  int match, readback, blank;
+  uint32_t flash_crc;
   uint8_t *flash_sector, *file_sector;
   struct flash_erase_block_t *eblock;
   unsigned eblock_num, eblock_addr;
@@ -650,6 +1003,9 @@ int cmd_program_flash(int pfd, const char *prom_fname)
   if ((flash_sector == NULL) || (file_sector == NULL))
      goto cmd_program_flash_exit;
 
+  flash_stage_probe(pfd);
+  use_crc = loader_has(MDPROTO_FEATURE_MEM_CRC32);
+  use_blank_check = loader_has(MDPROTO_FEATURE_FLASH_BLANK_CHECK);
   eblock = &sector_map[0];
   eblock_num=0;
   eblock_addr=0;
@@ -667,20 +1023,63 @@ int cmd_program_flash(int pfd, const char *prom_fname)
 
      gpsd_report(LOG_PROG, "0x%08x: sector_size: %u bytes\n", eblock_addr, sector_size);
 
-     /* Read sector from flash  */
-     if (dump_mem(pfd, EXT_SRAM_CSN0+eblock_addr, sector_size, flash_sector) != 0) {
-	gpsd_report(LOG_PROG, "Can't dump flash. Address: %u size: %u\n", eblock_addr, sector_size);
-	goto cmd_program_flash_exit;
+     /* Compare checksums first, the sector is read back only if it
+      * differs and is not blank */
+     match = 0;
+     readback = 1;
+     if (use_crc) {
+	if (dump_mem_crc32(pfd, flash_base()+eblock_addr,
+		 flash_base()+eblock_addr+read_size-1, &flash_crc) != 0) {
+	   gpsd_report(LOG_PROG, "sector checksums not supported\n");
+	   use_crc = 0;
+	}else {
+	   match = flash_crc == mdproto_crc32(0, file_sector, read_size);
+	   readback = !match;
+	}
      }
 
-     if ((unsigned)read_size < sector_size)
-	memcpy(&file_sector[read_size], &flash_sector[read_size], sector_size-read_size);
+     /* Erased sector is not read back */
+     if (readback && use_blank_check) {
+	blank = blank_check(pfd, eblock_addr, sector_size);
+	if (blank < 0) {
+	   gpsd_report(LOG_PROG, "blank check not supported\n");
+	   use_blank_check = 0;
+	}else if (blank) {
+	   gpsd_report(LOG_PROG, "Sector is blank\n");
+	   memset(flash_sector, 0xff, sector_size);
+	   if ((unsigned)read_size < sector_size)
+	      memset(&file_sector[read_size], 0xff, sector_size-read_size);
+	   match = memcmp(file_sector, flash_sector, read_size) == 0;
+	   readback = 0;
+	}
+     }
+
+     /* Read sector from flash  */
+     if (readback) {
+	if (dump_mem(pfd, flash_base()+eblock_addr, sector_size, flash_sector) != 0) {
+	   gpsd_report(LOG_PROG, "Can't dump flash. Address: %u size: %u\n", eblock_addr, sector_size);
+	   goto cmd_program_flash_exit;
+	}
+
+	if ((unsigned)read_size < sector_size)
+	   memcpy(&file_sector[read_size], &flash_sector[read_size], sector_size-read_size);
 
-     if (memcmp(file_sector, flash_sector, read_size) == 0) {
+	match = memcmp(file_sector, flash_sector, read_size) == 0;
+     }
+
+     if (match) {
 	gpsd_report(LOG_PROG, "Match.\n");
+     }else if (clears_bits_only(flash_sector, file_sector, sector_size)) {
+	gpsd_report(LOG_PROG, "Programming sector without erase...\n");
+	if (program_sector(pfd, eblock_addr, file_sector, sector_size, flash_sector) != 0)
+	   goto cmd_program_flash_exit;
+     }else if (flash_stage) {
+	gpsd_report(LOG_PROG, "Reprogramming sector...\n");
+	if (program_sector_staged(pfd, eblock_addr, file_sector, sector_size) != 0)
+	   goto cmd_program_flash_exit;
      }else {
 	gpsd_report(LOG_PROG, "Reprogramming sector...\n");
-	if (program_sector(pfd, eblock_addr, file_sector, sector_size) != 0)
+	if (program_sector(pfd, eblock_addr, file_sector, sector_size, NULL) != 0)
 	   goto cmd_program_flash_exit;
      }
 
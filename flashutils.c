@@ -194,34 +194,64 @@ sirfEnterInternalBootMode(int pfd){
 				0x94,		/* 0x94: firmware update */
 				0x00,0x00,	/* checksum */
 				0xb0,0xb3};	/* trailer */
+	/* 0x0b: command acknowledgment */
+	static const uint8_t ack[] = {0x0b, 0x94};
+
+	serialFlush(pfd);
 	status = sirf_write(pfd, msg);
+	if (!status)
+		return -1;
+
+	/*
+	 * The receiver acknowledges the message before it switches to the
+	 * boot ROM. Receivers without the ACK get the full timeout
+	 */
+	if (sirf_wait_msg(pfd, BOOT_SWITCH_TIMEOUT, PROTO_SIRF, ack, sizeof(ack)) > 0)
+		gpsd_report(LOG_PROG, "boot ROM switch acknowledged\n");
+
 	/* wait a moment for the receiver to switch to boot rom */
-	(void)sleep(2);
-	return status ? 0 : -1;
+	(void)usleep(100000);
+	serialFlush(pfd);
+	return 0;
+}
+
+/* Baud rate the boot ROM switches to, -1 if the tty can not do it */
+int
+sirfBoostSpeed(int boost){
+	switch(boost){
+	case BOOST_38400:
+		return 38400;
+#ifdef B57600
+	case BOOST_57600:
+		return 57600;
+#endif
+#ifdef B115200
+	case BOOST_115200:
+		return 115200;
+#endif
+	default:
+		return -1;
+	}
 }
 
+/*
+ * Send the loader to the boot ROM. With boost above BOOST_38400 the ROM
+ * is asked to raise the baud rate first. Old ROMs ignore the request,
+ * the caller should check that the loader has started.
+ */
 int
-sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls){
-	int r, speed = 38400;
-	unsigned char boost[] = {'S', BOOST_38400};
+sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls, int boost){
+	int r, speed;
+	unsigned char boost_cmd[] = {'S', BOOST_38400};
 	unsigned char *msg;
 
+	if((speed = sirfBoostSpeed(boost)) == -1)
+		return -1;
+
 	if((msg = malloc(ls+10)) == NULL){
 		return -1; /* oops. bail out */
 	}
 
-#if 0
-#ifdef B115200
-	speed = 115200;
-	boost[1] = BOOST_115200;
-#else
-#ifdef B57600
-	speed = 57600;
-	boost[1] = BOOST_57600;
-#endif
-#endif
-#endif
-
 	msg[0] = 'S';
 	msg[1] = (unsigned char)0;
 	msg[2] = (unsigned char)((ls & 0xff000000) >> 24);
@@ -231,19 +261,24 @@ sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls){
 	memcpy(msg+6, loader, ls); /* loader */
 	memset(msg+6+ls, 0, 4); /* reset vector */
 
-	/* send the command to jack up the speed */
-#if 0
-	if((r = (int)write(pfd, boost, 2)) != 2) {
-		free(msg);
-		return -1; /* oops. bail out */
+	if(boost != BOOST_38400){
+		/* send the command to jack up the speed */
+		boost_cmd[1] = (unsigned char)boost;
+		if((r = (int)write(pfd, boost_cmd, 2)) != 2) {
+			free(msg);
+			return -1; /* oops. bail out */
+		}
+
+		/* wait for the serial speed change to take effect */
+		(void)tcdrain(pfd);
+		(void)usleep(1000);
 	}
-#endif
-	/* wait for the serial speed change to take effect */
-	(void)tcdrain(pfd);
-	(void)usleep(1000);
 
-	/* now set up the serial port at this higher speed */
-	(void)serialSpeed(pfd, term, speed);
+	/* now set up the serial port at this speed */
+	if(serialSpeed(pfd, term, speed) == -1){
+		free(msg);
+		return -1;
+	}
 
 	/* ship the actual data */
 	r = binary_send(pfd, (char *)msg, ls+10);
@@ -251,11 +286,12 @@ sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls){
 	return r;
 }
 
-int
-sirfSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int proto){
-	int i;
-	int spd[8] = {115200, 57600, 38400, 28800, 19200, 14400, 9600, 4800};
-	static unsigned char sirf[] =	{
+/* Rates the receiver may be talking at. Detection starts with SiRF
+ * binary and NMEA defaults */
+static int spd[8] = {115200, 57600, 38400, 28800, 19200, 14400, 9600, 4800};
+static const int detect_spd[8] = {38400, 4800, 9600, 19200, 57600, 115200, 28800, 14400};
+
+static unsigned char sirf_uart_config[] = {
 				0xa0,0xa2,	/* header */
 				0x00,0x31,	/* message length */
 				0xa5,		/* message 0xa5: UART config */
@@ -266,14 +302,69 @@ sirfSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int pro
 				0x00,0x00,	/* checksum */
 				0xb0,0xb3};	/* trailer */
 
-	if (serialConfig(pfd, term, 38400) == -1)
-		return -1;
+static unsigned char *
+sirfUartConfig(unsigned int speed, unsigned int proto){
+	unsigned char *sirf = sirf_uart_config;
 
 	sirf[7] = sirf[6] = (unsigned char)proto;
 	sirf[8] = (unsigned char)((speed & 0xff000000) >> 24);
 	sirf[9] = (unsigned char)((speed & 0xff0000) >> 16);
 	sirf[10] = (unsigned char)((speed & 0xff00) >> 8);
 	sirf[11] = (unsigned char)(speed & 0xff);
+	return sirf;
+}
+
+/*
+ * Listen for the receiver instead of spamming every rate: find its rate
+ * and protocol, reconfigure it with one message in that protocol and wait
+ * until it talks at the new settings. Returns -1 if the receiver is not
+ * heard, sirfSetProto() is the fallback
+ */
+int
+sirfDetectSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int proto){
+	int cur_speed;
+	unsigned cur_proto;
+
+	if (serialConfig(pfd, term, 38400) == -1)
+		return -1;
+
+	cur_speed = serialDetect(pfd, term, detect_spd,
+	    sizeof(detect_spd)/sizeof(detect_spd[0]), &cur_proto);
+	if (cur_speed == -1)
+		return -1;
+
+	if ((cur_speed == (int)speed) && (cur_proto == proto)) {
+		serialFlush(pfd);
+		return 0;
+	}
+
+	if (cur_proto == PROTO_SIRF)
+		(void)sirf_write(pfd, sirfUartConfig(speed, proto));
+	else {
+		nmea_lowlevel_send(pfd, "$PSRF100,%u,%u,8,1,0", proto, speed);
+		(void)tcdrain(pfd);
+	}
+
+	(void)serialSpeed(pfd, term, (int)speed);
+	serialFlush(pfd);
+
+	if (sirf_wait_msg(pfd, PROTO_SWITCH_TIMEOUT, proto, NULL, 0) <= 0)
+		return -1;
+	gpsd_report(LOG_PROG, "receiver switched to %u baud\n", speed);
+	serialFlush(pfd);
+
+	return 0;
+}
+
+int
+sirfSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int proto){
+	int i;
+	unsigned char *sirf;
+
+	if (serialConfig(pfd, term, 38400) == -1)
+		return -1;
+
+	sirf = sirfUartConfig(speed, proto);
 
 	/* send at whatever baud we're currently using */
 	(void)sirf_write(pfd, sirf);
@@ -291,7 +382,7 @@ sirfSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int pro
 	}
 
 	(void)serialSpeed(pfd, term, (int)speed);
-	(void)tcflush(pfd, TCIOFLUSH);
+	serialFlush(pfd);
 
 	return 0;
 }
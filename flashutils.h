@@ -20,6 +20,7 @@
 #ifndef FLASHUTILS_H
 #define FLAHUTILS_H
 
+#include <limits.h>
 #include <termios.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -35,31 +36,143 @@
 #define BOOST_115200 2
 
 #define DEFAULT_LOADER "sirfmemdump.bin"
+#define DEFAULT_BOOT_STUB "sirfboot.bin"
 #define DEFAULT_PORT "/dev/ttyp0"
+#define DEFAULT_WINDOW 4
+#define DEFAULT_LINK_SPEED 115200
+#define DEFAULT_FCS MDPROTO_FCS_CRC32
+#define DEFAULT_MTU 4096
+
+/* Loader re-injections during one dump to file */
+#define DUMP_MAX_REINJECTS 2
+
+/* Baud rate the loader starts at */
+#define LOADER_SPEED 38400
+
+/* Loader "+++" banner timeout, s. Banner timeout after a boosted boot
+ * ROM transfer, s: the ROM ignores unsupported boosts */
+#define LOADER_BANNER_TIMEOUT 30
+#define ROM_BOOST_TIMEOUT 5
+
+/* Baud rate switch: delay before the first request at the new rate, us.
+ * PING timeout, ms and number of PINGs at the old rate on failure */
+#define BAUD_SWITCH_DELAY 50000
+#define BAUD_PING_TIMEOUT 1000
+#define BAUD_FALLBACK_TRIES 5
+
+/* Largest baud rate error accepted from the loader UART divider, % */
+#define LINK_BAUD_TOLERANCE 3
+
+/* PING timeout for a loader left running by the previous invocation, ms */
+#define REUSE_PING_TIMEOUT 500
+
+/* read_mdproto_pkt() timeout, ms. Covers the longest sector erase */
+#define MDPROTO_READ_TIMEOUT 30000
+#if MDPROTO_READ_TIMEOUT <= MDPROTO_FLASH_MAX_WAIT
+#error MDPROTO_READ_TIMEOUT must be longer than the loader flash deadline
+#endif
+
+/* Boot stub: MDBOOT_READY timeout, s. Response timeout, ms, on top of
+ * the transfer time */
+#define MDBOOT_READY_TIMEOUT 10
+#define MDBOOT_RESPONSE_TIMEOUT 1000
+
+/* Receiver detection, ms: listening time per rate (receivers report once
+ * a second), gap ending a burst on top of one sentence time. Wait for the
+ * receiver at the new rate after reconfiguration and for the ACK of the
+ * boot ROM switch */
+#define DETECT_PERIOD_MS 1100
+#define DETECT_QUIET_MS 50
+#define PROTO_SWITCH_TIMEOUT 2000
+#define BOOT_SWITCH_TIMEOUT 2000
+
+/* Longest NMEA sentence accepted, bytes */
+#define NMEA_MAX_SIZE 96
 
 #define LOG_ERROR 0
 #define LOG_PROG 1
 #define LOG_RAW 2
 
 int sirfEnterInternalBootMode(int pfd);
-int sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls);
+int sirfBoostSpeed(int boost);
+int sirfSendLoader(int pfd, struct termios *term, char *loader, size_t ls, int boost);
 int sirfSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int proto);
+int sirfDetectSetProto(int pfd, struct termios *term, unsigned int speed, unsigned int proto);
 int serialSpeed(int pfd, struct termios *term, int speed);
 int serialConfig(int pfd, struct termios *term, int speed);
+void serialFlush(int pfd);
+void serialDrain(int pfd, int quiet_ms, int max_ms);
 
 void gpsd_report(int errlevel, const char *fmt, ... );
 
 /* serial.c */
 int read_full(int d, void *buf, size_t nbytes);
 int read_mdproto_pkt(int pfd, struct mdproto_cmd_buf_t *dst);
+int read_mdproto_pkt_tmout(int pfd, struct mdproto_cmd_buf_t *dst, int timeout_ms);
 int expect(int pfd, const char *str, size_t len, time_t timeout);
-
+int sirf_wait_msg(int pfd, int timeout_ms, unsigned proto, const uint8_t *payload, size_t len);
+int serialDetect(int pfd, struct termios *term, const int *speeds, unsigned n,
+      unsigned *proto);
+int mdproto_set_param(int pfd, unsigned param, uint32_t *value);
+int mdproto_ping(int pfd, int timeout_ms);
+int mdproto_set_baud(int pfd, struct termios *term, int speed);
+int mdproto_hello(int pfd);
+int mdboot_set_baud(int pfd, struct termios *term, int speed, int cur_speed);
+int mdboot_load(int pfd, const uint8_t *loader, size_t ls, int compress, int speed);
+
+/* Loader description from MDPROTO_CMD_HELLO, valid until the loader is
+ * injected again. Multi-byte fields are in host byte order, except
+ * flash_info */
+struct loader_info_t {
+   int valid;
+   struct mdproto_hello_t hello;
+};
+extern struct loader_info_t loader_info;
+int loader_has(unsigned feature);
+
+/* dump.c */
+typedef int (*dump_sink_t)(void *ctx, unsigned addr, const uint8_t *data, unsigned size);
+int dump_lz_probe(int pfd);
+int dump_mem_range(int pfd, unsigned src_addr, unsigned dst_addr,
+      dump_sink_t sink, void *ctx);
+int dump_mem_crc32(int pfd, unsigned src_addr, unsigned dst_addr, uint32_t *crc);
+
+/* journal.c */
+#define JOURNAL_BLOCK_SIZE 4096
+#define JOURNAL_SUFFIX ".journal"
+
+/* Completed blocks of the dump to file */
+struct dump_journal_t {
+   int fd;
+   char fname[PATH_MAX];
+   unsigned src_addr;
+   unsigned dst_addr;
+   unsigned blocks;
+   uint8_t *bitmap;
+};
+
+int journal_open(struct dump_journal_t *j, const char *out_fname,
+      unsigned src_addr, unsigned dst_addr);
+int journal_next(const struct dump_journal_t *j, unsigned *from, unsigned *to);
+int journal_mark(struct dump_journal_t *j, unsigned *from, unsigned last);
+void journal_close(struct dump_journal_t *j, int complete);
+
+/* server.c */
+#define SERVER_MAX_CLIENTS 8
+#define SERVER_MAX_ARGS 32
+#define SERVER_LINE_MAX 1024
+/* Client not reading its response this long (s) is dropped */
+#define SERVER_SEND_TIMEOUT 10
+
+typedef int (*server_cmd_t)(int pfd, struct termios *term, int argc, char **argv);
+int server_run(int pfd, struct termios *term, const char *path, server_cmd_t cmd);
 
 /* flash.c */
 void flash_get_name(unsigned manufacturer_id, unsigned device_id,
       const char **manufacturer, const char **device);
 int dump_flash_info(const struct mdproto_cmd_flash_info_t *data);
 
+int flash_lz_probe(int pfd);
 int cmd_flash_info(int pfd);
 int cmd_program_word(int pfd, unsigned addr, uint16_t word);
 int cmd_program_flash(int pfd, const char *prom_fname);
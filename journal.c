@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flashutils.h"
+
+#define JOURNAL_MAGIC "SMDJ"
+#define JOURNAL_VERSION 1
+
+struct journal_hdr_t {
+   char magic[4];
+   uint32_t version;
+   uint32_t src_addr;
+   uint32_t dst_addr;
+   uint32_t block_size;
+} __attribute__((packed));
+
+static unsigned block_last(const struct dump_journal_t *j, unsigned i)
+{
+   unsigned last;
+
+   last = j->src_addr + (i+1) * JOURNAL_BLOCK_SIZE - 1;
+   if ((last < j->src_addr) || (last > j->dst_addr))
+      last = j->dst_addr;
+   return last;
+}
+
+static int block_done(const struct dump_journal_t *j, unsigned i)
+{
+   return j->bitmap[i / 8] & (1 << (i % 8));
+}
+
+/*
+ * Open journal of the dump [src_addr, dst_addr] to out_fname.
+ * Returns 1 if an unfinished dump of the same range is found, 0 for
+ * a new dump, -1 on error.
+ */
+int journal_open(struct dump_journal_t *j, const char *out_fname,
+      unsigned src_addr, unsigned dst_addr)
+{
+   struct journal_hdr_t hdr;
+   size_t bitmap_size;
+   int resumed;
+
+   j->src_addr = src_addr;
+   j->dst_addr = dst_addr;
+   j->blocks = (dst_addr - src_addr) / JOURNAL_BLOCK_SIZE + 1;
+   bitmap_size = (j->blocks + 7) / 8;
+
+   if (snprintf(j->fname, sizeof(j->fname), "%s" JOURNAL_SUFFIX, out_fname)
+	 >= (int)sizeof(j->fname)) {
+      gpsd_report(LOG_ERROR, "%s: file name too long\n", out_fname);
+      return -1;
+   }
+
+   j->bitmap = (uint8_t *)calloc(1, bitmap_size);
+   if (j->bitmap == NULL)
+      return -1;
+
+   resumed = 0;
+   j->fd = open(j->fname, O_RDWR);
+   if (j->fd >= 0) {
+      if ((read(j->fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr))
+	    && (memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) == 0)
+	    && (hdr.version == JOURNAL_VERSION)
+	    && (hdr.src_addr == src_addr)
+	    && (hdr.dst_addr == dst_addr)
+	    && (hdr.block_size == JOURNAL_BLOCK_SIZE)
+	    && (read(j->fd, j->bitmap, bitmap_size) == (ssize_t)bitmap_size)
+	    && (access(out_fname, W_OK) == 0))
+	 resumed = 1;
+      else
+	 close(j->fd);
+   }
+
+   if (!resumed) {
+      memset(j->bitmap, 0, bitmap_size);
+      j->fd = open(j->fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (j->fd < 0) {
+	 gpsd_report(LOG_ERROR, "open(%s): %s\n", j->fname, strerror(errno));
+	 free(j->bitmap);
+	 return -1;
+      }
+      memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+      hdr.version = JOURNAL_VERSION;
+      hdr.src_addr = src_addr;
+      hdr.dst_addr = dst_addr;
+      hdr.block_size = JOURNAL_BLOCK_SIZE;
+      if ((write(j->fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+	    || (write(j->fd, j->bitmap, bitmap_size) != (ssize_t)bitmap_size)) {
+	 gpsd_report(LOG_ERROR, "write(%s): %s\n", j->fname, strerror(errno));
+	 journal_close(j, 0);
+	 return -1;
+      }
+   }
+
+   return resumed;
+}
+
+/*
+ * Find the next range of unfinished blocks starting from *from.
+ * Returns 0 if there is nothing left.
+ */
+int journal_next(const struct dump_journal_t *j, unsigned *from, unsigned *to)
+{
+   unsigned i;
+
+   i = (*from - j->src_addr) / JOURNAL_BLOCK_SIZE;
+   while ((i < j->blocks) && block_done(j, i))
+      i++;
+   if (i >= j->blocks)
+      return 0;
+
+   *from = j->src_addr + i * JOURNAL_BLOCK_SIZE;
+   while ((i < j->blocks) && !block_done(j, i))
+      i++;
+   *to = block_last(j, i-1);
+
+   return 1;
+}
+
+/* Mark blocks that start at or after *from and end at or before last.
+ * *from is moved to the first block not marked */
+int journal_mark(struct dump_journal_t *j, unsigned *from, unsigned last)
+{
+   unsigned i;
+   off_t offset;
+
+   i = (*from - j->src_addr) / JOURNAL_BLOCK_SIZE;
+   while ((i < j->blocks) && (block_last(j, i) <= last)) {
+      j->bitmap[i / 8] |= 1 << (i % 8);
+      offset = (off_t)sizeof(struct journal_hdr_t) + i / 8;
+      if (pwrite(j->fd, &j->bitmap[i / 8], 1, offset) != 1) {
+	 gpsd_report(LOG_ERROR, "write(%s): %s\n", j->fname, strerror(errno));
+	 return -1;
+      }
+      i++;
+      *from = j->src_addr + i * JOURNAL_BLOCK_SIZE;
+   }
+
+   return 0;
+}
+
+/* Close journal. It is removed when the dump is complete */
+void journal_close(struct dump_journal_t *j, int complete)
+{
+   close(j->fd);
+   if (complete)
+      unlink(j->fname);
+   free(j->bitmap);
+   j->bitmap = NULL;
+}
@@ -15,52 +15,149 @@
  */
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "flashutils.h"
+#include "arm/include/mdboot.h"
+#include "arm/include/mdlz.h"
 #include "arm/include/mdproto.h"
 
-int serialSpeed(int pfd, struct termios *term, int speed){
-	int rv;
-	int r = 0;
+/* Receive buffer. Each read() takes as many bytes as the tty has and
+ * frames are parsed in place, so a stream of MEM_READ responses costs
+ * one syscall per several frames instead of two per frame */
+#define RX_BUF_SIZE 8192
+
+static struct {
+   uint8_t buf[RX_BUF_SIZE];
+   size_t pos;   /* first unparsed byte */
+   size_t len;   /* end of received data */
+} rx;
+
+static void deadline_init(struct timespec *deadline, int timeout_ms)
+{
+   clock_gettime(CLOCK_MONOTONIC, deadline);
+   deadline->tv_sec += timeout_ms / 1000;
+   deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+   if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+   }
+}
+
+static int deadline_ms_left(const struct timespec *deadline)
+{
+   struct timespec now;
+   long ms;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   ms = (long)(deadline->tv_sec - now.tv_sec) * 1000L
+      + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+
+   return ms < 0 ? 0 : (int)ms;
+}
+
+/* Wait up to timeout_ms for data and append it to the receive buffer.
+ * Returns number of bytes read, 0 on timeout, -1 on error */
+static ssize_t rx_fill(int pfd, int timeout_ms)
+{
+   struct pollfd pfds;
+   ssize_t cnt;
+   int res;
+
+   /* Keep unparsed data contiguous at the start of the buffer */
+   if (rx.pos != 0) {
+      memmove(rx.buf, &rx.buf[rx.pos], rx.len - rx.pos);
+      rx.len -= rx.pos;
+      rx.pos = 0;
+   }
+
+   if (rx.len == sizeof(rx.buf))
+      return 0;
+
+   pfds.fd = pfd;
+   pfds.events = POLLIN;
+   pfds.revents = 0;
+
+   res = poll(&pfds, 1, timeout_ms);
+   if (res < 0)
+      return errno == EINTR ? 0 : -1;
+   if (res == 0)
+      return 0;
+
+   cnt = read(pfd, &rx.buf[rx.len], sizeof(rx.buf) - rx.len);
+   if (cnt < 0)
+      return ((errno == EINTR) || (errno == EAGAIN)) ? 0 : -1;
+
+   gpsd_report(LOG_RAW, "read() %zd bytes\n", cnt);
+   rx.len += (size_t)cnt;
+
+   return cnt;
+}
+
+void serialFlush(int pfd)
+{
+   (void)tcflush(pfd, TCIOFLUSH);
+   rx.pos = rx.len = 0;
+}
 
+static speed_t baud_constant(int speed)
+{
 	switch(speed){
+#ifdef B921600
+	case 921600:
+		return B921600;
+#endif
+#ifdef B460800
+	case 460800:
+		return B460800;
+#endif
+#ifdef B230400
+	case 230400:
+		return B230400;
+#endif
 #ifdef B115200
 	case 115200:
-		speed = B115200;
-		break;
+		return B115200;
 #endif
 #ifdef B57600
 	case 57600:
-		speed = B57600;
-		break;
+		return B57600;
 #endif
 	case 38400:
-		speed = B38400;
-		break;
+		return B38400;
 #ifdef B28800
 	case 28800:
-		speed = B28800;
-		break;
+		return B28800;
 #endif
 	case 19200:
-		speed = B19200;
-		break;
+		return B19200;
 #ifdef B14400
 	case 14400:
-		speed = B14400;
-		break;
+		return B14400;
 #endif
 	case 9600:
-		speed = B9600;
-		break;
+		return B9600;
 	case 4800:
-		speed = B9600;
-		break;
+		return B4800;
 	default:
+		break;
+	}
+	return B0;
+}
+
+int serialSpeed(int pfd, struct termios *term, int speed){
+	int rv;
+	int r = 0;
+
+	speed = baud_constant(speed);
+	if (speed == B0) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -75,6 +172,9 @@ int serialSpeed(int pfd, struct termios *term, int speed){
 		r++;
 	}
 
+	/* TCSAFLUSH discards input received at the old speed */
+	rx.pos = rx.len = 0;
+
 	return rv == -1 ? -1 : 0;
 }
 
@@ -127,33 +227,238 @@ int serialConfig(int pfd, struct termios *term, int speed){
 	return serialSpeed(pfd, term, speed);
 }
 
+/* Discard input until the line is quiet for quiet_ms */
+void serialDrain(int pfd, int quiet_ms, int max_ms)
+{
+   struct timespec deadline;
+
+   deadline_init(&deadline, max_ms);
+   do {
+      rx.pos = rx.len = 0;
+   } while ((rx_fill(pfd, quiet_ms) > 0) && (deadline_ms_left(&deadline) > 0));
+
+   serialFlush(pfd);
+}
+
 int expect(int pfd, const char *str, size_t len, time_t timeout)
 /* keep reading till we see a specified expect string or time out */
 {
     size_t got = 0;
-    char ch;
-    ssize_t read_cnt;
-    double start = clock();
+    uint8_t ch;
+    struct timespec deadline;
+
+    deadline_init(&deadline, (int)timeout * 1000);
 
     for (;;) {
-        read_cnt = read(pfd, &ch, 1);
-	if (read_cnt <  0)
-	    return 0;		/* I/O failed */
-	if (read_cnt > 0)
-	   gpsd_report(LOG_RAW, "I see %zd: %02x\n", got, (unsigned)(ch & 0xff));
-	if ((clock() - start) > (double)timeout*CLOCKS_PER_SEC)
-	    return 0;		/* we're timed out */
-	if (read_cnt > 0) {
-	   if (ch == str[got])
-	       got++;			/* match continues */
+	while (rx.pos < rx.len) {
+	   ch = rx.buf[rx.pos++];
+	   gpsd_report(LOG_RAW, "I see %zd: %02x\n", got, (unsigned)ch);
+	   if (ch == (uint8_t)str[got])
+	      got++;			/* match continues */
 	   else
-	       got = 0;			/* match fails, retry */
-	    if (got == len)
-	       return 1;
+	      got = (ch == (uint8_t)str[0]) ? 1 : 0;	/* match fails, retry */
+	   if (got == len)
+	      return 1;
 	}
+	if (deadline_ms_left(&deadline) == 0)
+	    return 0;		/* we're timed out */
+	if (rx_fill(pfd, deadline_ms_left(&deadline)) < 0)
+	    return 0;		/* I/O failed */
     }
 }
 
+/* Returns 0 - not NMEA, <0 - maybe truncated, >0 - NMEA, message size.
+ * Sentences without checksum are not accepted: line noise at a wrong
+ * rate should not pass */
+static int nmea_is_msg(const uint8_t *buf, size_t buf_size)
+{
+   size_t p;
+   unsigned csum;
+   char hex[3];
+   char *endptr;
+
+   if (buf_size < 1)
+      return -1;
+   if (buf[0] != '$')
+      return 0;
+
+   /* $GPxx, $PSxx */
+   for (p=1; p < 5; p++) {
+      if (p >= buf_size)
+	 return -1;
+      if (!isalpha(buf[p]))
+	 return 0;
+   }
+
+   csum = 0;
+   for (p=1; buf[p] != '*'; p++) {
+      if (p >= NMEA_MAX_SIZE)
+	 return 0;
+      if (buf[p] == '\r')
+	 return 0;
+      csum ^= buf[p];
+      if (p+1 >= buf_size)
+	 return -1;
+   }
+
+   if (p+3 >= buf_size)
+      return -1;
+   if (buf[p+3] != '\r')
+      return 0;
+
+   hex[0] = (char)buf[p+1];
+   hex[1] = (char)buf[p+2];
+   hex[2] = '\0';
+   if ((strtoul(hex, &endptr, 16) != csum) || (*endptr != '\0'))
+      return 0;
+
+   return (int)(p+4);
+}
+
+/* Returns 0 - not SiRF binary, <0 - maybe truncated, >0 - message size */
+static int sirf_is_msg(const uint8_t *buf, size_t buf_size)
+{
+   unsigned i, csum, payload_size;
+
+   if (buf_size < 2)
+      return -1;
+   if ((buf[0] != 0xa0) || (buf[1] != 0xa2))
+      return 0;
+   if (buf_size < 4)
+      return -1;
+
+   payload_size = (buf[2] << 8) | buf[3];
+   if (payload_size > 1023)
+      return 0;
+   if (payload_size + 8 > buf_size)
+      return -1;
+
+   if ((buf[4+payload_size+2] != 0xb0) || (buf[4+payload_size+3] != 0xb3))
+      return 0;
+
+   csum = 0;
+   for (i=0; i < payload_size; i++)
+      csum += buf[4+i];
+   if ((csum & 0x7fff) != (unsigned)((buf[4+payload_size] << 8) | buf[4+payload_size+1]))
+      return 0;
+
+   return (int)(payload_size + 8);
+}
+
+/*
+ * Next NMEA or SiRF binary message from the receiver. Noise before it is
+ * skipped. Returns message size and sets proto and msg (valid until the
+ * next read), 0 on timeout, -1 on error
+ */
+static int sirf_read_msg(int pfd, int timeout_ms, unsigned *proto, const uint8_t **msg)
+{
+   int size;
+   struct timespec deadline;
+
+   deadline_init(&deadline, timeout_ms);
+
+   for (;;) {
+      while (rx.pos < rx.len) {
+	 *proto = PROTO_SIRF;
+	 size = sirf_is_msg(&rx.buf[rx.pos], rx.len - rx.pos);
+	 if (size == 0) {
+	    *proto = PROTO_NMEA;
+	    size = nmea_is_msg(&rx.buf[rx.pos], rx.len - rx.pos);
+	 }
+	 if (size > 0) {
+	    *msg = &rx.buf[rx.pos];
+	    rx.pos += (size_t)size;
+	    return size;
+	 }
+	 if (size < 0)
+	    break;
+	 rx.pos++;
+      }
+
+      /* Truncated message fills the whole buffer */
+      if ((rx.pos == 0) && (rx.len == sizeof(rx.buf)))
+	 rx.pos++;
+
+      if (deadline_ms_left(&deadline) == 0)
+	 return 0;
+      if (rx_fill(pfd, deadline_ms_left(&deadline)) < 0)
+	 return -1;
+   }
+}
+
+/*
+ * Wait for a message in proto. SiRF binary payload should start with
+ * len bytes of payload. Returns 1 if received, 0 on timeout, -1 on error
+ */
+int sirf_wait_msg(int pfd, int timeout_ms, unsigned proto, const uint8_t *payload, size_t len)
+{
+   int size;
+   unsigned msg_proto;
+   const uint8_t *msg;
+   struct timespec deadline;
+
+   deadline_init(&deadline, timeout_ms);
+
+   while ((size = sirf_read_msg(pfd, deadline_ms_left(&deadline), &msg_proto, &msg)) > 0) {
+      if (msg_proto != proto)
+	 continue;
+      if ((proto != PROTO_SIRF)
+	    || (len == 0)
+	    || (((size_t)size >= len + 8) && (memcmp(&msg[4], payload, len) == 0)))
+	 return 1;
+   }
+
+   return size;
+}
+
+/*
+ * Listen for the receiver at each of the rates in turn. A rate is given
+ * one report period, but only until its first burst of data is over.
+ * Returns the rate and sets proto, -1 if nothing is heard
+ */
+int serialDetect(int pfd, struct termios *term, const int *speeds, unsigned n,
+      unsigned *proto)
+{
+   unsigned i;
+   int heard, quiet, tmo;
+   ssize_t cnt;
+   const uint8_t *msg;
+   struct timespec period;
+
+   heard = 0;
+   for (i=0; i < n; i++) {
+      if (serialSpeed(pfd, term, speeds[i]) != 0)
+	 continue;
+      /* Bytes received at the previous rate are noise */
+      serialFlush(pfd);
+
+      /* Gap longer than a sentence ends the burst */
+      quiet = DETECT_QUIET_MS + NMEA_MAX_SIZE * 10 * 1000 / speeds[i];
+      deadline_init(&period, DETECT_PERIOD_MS);
+      cnt = 0;
+
+      for (;;) {
+	 if (sirf_read_msg(pfd, 0, proto, &msg) > 0) {
+	    gpsd_report(LOG_PROG, "receiver found at %d baud, %s\n", speeds[i],
+		  *proto == PROTO_SIRF ? "SiRF binary" : "NMEA");
+	    return speeds[i];
+	 }
+	 tmo = deadline_ms_left(&period);
+	 if ((cnt != 0) && (tmo > quiet))
+	    tmo = quiet;
+	 if ((tmo == 0) || ((cnt = rx_fill(pfd, tmo)) <= 0))
+	    break;
+	 heard = 1;
+      }
+
+      /* Silent line at any rate: nothing to detect */
+      if (!heard)
+	 break;
+   }
+
+   return -1;
+}
+
 int read_full(int d, void *buf, size_t nbytes)
 {
     size_t got = 0;
@@ -169,33 +474,435 @@ int read_full(int d, void *buf, size_t nbytes)
     return (int)got;
 }
 
+static int is_mdproto_status(uint8_t c)
+{
+   switch (c) {
+      case MDPROTO_STATUS_WRONG_CMD:
+      case MDPROTO_STATUS_READ_HEADER_TIMEOUT:
+      case MDPROTO_STATUS_READ_DATA_TIMEOUT:
+      case MDPROTO_STATUS_TOO_BIG:
+      case MDPROTO_STATUS_WRONG_CSUM:
+      case MDPROTO_STATUS_WRONG_PARAM:
+	 return 1;
+      default:
+	 break;
+   }
+   return 0;
+}
+
+int read_mdproto_pkt_tmout(int pfd, struct mdproto_cmd_buf_t *dst, int timeout_ms)
+{
+   uint8_t *p;
+   size_t avail;
+   size_t size;
+   int status;
+   struct timespec deadline;
+
+   deadline_init(&deadline, timeout_ms);
+
+   for (;;) {
+      p = &rx.buf[rx.pos];
+      avail = rx.len - rx.pos;
+
+      /* Frame size is at most MTU + id + seq. Anything else in the
+       * high byte is a status byte of the stop-and-wait mode or garbage */
+      if ((avail >= 1) && (p[0] > ((mdproto_link.mtu + 2) >> 8))) {
+	 rx.pos++;
+	 if (!mdproto_link.window && is_mdproto_status(p[0]))
+	    return p[0];
+	 gpsd_report(LOG_RAW, "skip 0x%02x\n", (unsigned)p[0]);
+	 continue;
+      }
+
+      if (avail >= sizeof(dst->size)) {
+	 size = ((size_t)p[0] << 8) | p[1];
+	 if (size > mdproto_link.mtu + 2) {
+	    rx.pos++;
+	    continue;
+	 }
+
+	 /* size, data, fcs */
+	 if (avail >= sizeof(dst->size) + size + mdproto_fcs_size()) {
+	    memcpy(dst, p, sizeof(dst->size) + size + mdproto_fcs_size());
+	    status = mdproto_pkt_check(dst);
+	    if (status != MDPROTO_STATUS_OK) {
+	       /* Resynchronize on the next byte */
+	       rx.pos++;
+	       return status;
+	    }
+	    rx.pos += sizeof(dst->size) + size + mdproto_fcs_size();
+
+	    /* Window mode: loader reports errors with NAK frames */
+	    if (dst->data.id == MDPROTO_CMD_NAK) {
+	       if (MDPROTO_CMD_SIZE(*dst) != 1+1)
+		  return MDPROTO_STATUS_WRONG_PARAM;
+	       return dst->data.p[1];
+	    }
+
+	    return MDPROTO_STATUS_OK;
+	 }
+      }
+
+      if (deadline_ms_left(&deadline) == 0)
+	 return avail == 0 ? MDPROTO_STATUS_READ_HEADER_TIMEOUT : MDPROTO_STATUS_READ_DATA_TIMEOUT;
+
+      if (rx_fill(pfd, deadline_ms_left(&deadline)) < 0) {
+	 gpsd_report(LOG_PROG, "read() error: %s\n", strerror(errno));
+	 return MDPROTO_STATUS_READ_HEADER_TIMEOUT;
+      }
+   }
+}
+
 int read_mdproto_pkt(int pfd, struct mdproto_cmd_buf_t *dst)
 {
-   ssize_t cnt;
-   uint16_t size;
+   return read_mdproto_pkt_tmout(pfd, dst, MDPROTO_READ_TIMEOUT);
+}
+
+int mdproto_set_param(int pfd, unsigned param, uint32_t *value)
+{
+   int write_size;
+   int read_status;
+   struct mdproto_cmd_buf_t cmd;
+   struct {
+      uint8_t param;
+      uint32_t value;
+   } __attribute__((packed)) req;
+   struct resp_t {
+      int8_t res;
+      uint32_t value;
+   } __attribute__((packed)) *resp;
+
+   req.param = (uint8_t)param;
+   req.value = htonl(*value);
+   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_SET_PARAM, &req, sizeof(req));
+   gpsd_report(LOG_PROG, "SET-PARAM 0x%x = %u...\n", param, (unsigned)*value);
+
+   serialFlush(pfd);
+   if (write(pfd, (void *)&cmd, write_size) < write_size) {
+      gpsd_report(LOG_PROG, "write() error\n");
+      return -1;
+   }
+
+   read_status = read_mdproto_pkt(pfd, &cmd);
+   if (read_status != MDPROTO_STATUS_OK) {
+      gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+      return -1;
+   }
+
+   if (cmd.data.id != MDPROTO_CMD_SET_PARAM_RESPONSE) {
+      gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+      return -1;
+   }
+
+   if (MDPROTO_CMD_SIZE(cmd) != sizeof(*resp)+1) {
+      gpsd_report(LOG_PROG, "received wrong response size `0x%x`\n", MDPROTO_CMD_SIZE(cmd));
+      return -1;
+   }
 
-   cnt = read_full(pfd, (void *)&dst->size, sizeof(dst->size));
-   if (cnt < 0) {
-      gpsd_report(LOG_PROG, "read() error: %s\n", strerror(errno));
-      return MDPROTO_STATUS_READ_HEADER_TIMEOUT;
+   resp = (struct resp_t *)&cmd.data.p[1];
+   if (resp->res != 0) {
+      gpsd_report(LOG_PROG, "parameter 0x%x not supported\n", param);
+      return -1;
    }
+   *value = ntohl(resp->value);
 
-   if (cnt < (ssize_t)sizeof(dst->size))
-      return MDPROTO_STATUS_READ_HEADER_TIMEOUT;
+   /* New value takes effect after the response */
+   switch (param) {
+      case MDPROTO_PARAM_WINDOW:
+	 mdproto_link.window = *value;
+	 break;
+      case MDPROTO_PARAM_FCS:
+	 mdproto_link.fcs = *value;
+	 break;
+      case MDPROTO_PARAM_MTU:
+	 mdproto_link.mtu = *value;
+	 break;
+      default:
+	 break;
+   }
+
+   gpsd_report(LOG_PROG, "OK (%u)\n", (unsigned)*value);
+   return 0;
+}
+
+struct loader_info_t loader_info;
+
+/* Ask loader for its description. Old loaders reply with
+ * MDPROTO_STATUS_WRONG_CMD, loader_info stays invalid */
+int mdproto_hello(int pfd)
+{
+   int write_size;
+   int read_status;
+   struct mdproto_cmd_buf_t cmd;
+   struct mdproto_hello_t *h;
+
+   loader_info.valid = 0;
+
+   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_HELLO, NULL, 0);
+   gpsd_report(LOG_PROG, "HELLO...\n");
+
+   serialFlush(pfd);
+   if (write(pfd, (void *)&cmd, write_size) < write_size) {
+      gpsd_report(LOG_PROG, "write() error\n");
+      return -1;
+   }
+   mdproto_link.seq++;
+
+   read_status = read_mdproto_pkt(pfd, &cmd);
+   if (read_status != MDPROTO_STATUS_OK) {
+      gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+      return -1;
+   }
+
+   if ((cmd.data.id != MDPROTO_CMD_HELLO_RESPONSE)
+	 || (MDPROTO_CMD_SIZE(cmd) != sizeof(*h)+1)) {
+      gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+      return -1;
+   }
 
-   size = ntohs(dst->size);
-   if (size > sizeof(dst->data.p))
-      return MDPROTO_STATUS_TOO_BIG;
+   h = &loader_info.hello;
+   memcpy(h, &cmd.data.p[1], sizeof(*h));
+   h->features = ntohl(h->features);
+   h->flash_base = ntohl(h->flash_base);
+   h->uart_clock = ntohl(h->uart_clock);
+   h->mtu_max = ntohs(h->mtu_max);
+   h->stage_slot_size = ntohs(h->stage_slot_size);
+   h->version[sizeof(h->version)-1] = '\0';
+   loader_info.valid = 1;
 
-   cnt = read_full(pfd, (void *)dst->data.p, size+1);
-   if (cnt < size+1)
-      return MDPROTO_STATUS_READ_DATA_TIMEOUT;
+   gpsd_report(LOG_PROG, "loader `%s`, protocol %u, gps 0x%x, flash %u-bit at 0x%x, "
+	 "features 0x%x, MTU %u\n",
+	 h->version, (unsigned)h->proto_version, (unsigned)h->gps_version,
+	 (unsigned)h->flash_bus_width, (unsigned)h->flash_base,
+	 (unsigned)h->features, (unsigned)h->mtu_max);
 
-   if (dst->data.p[size] != mdproto_pkt_csum(dst, size+2))
-      return MDPROTO_STATUS_WRONG_CSUM;
+   return 0;
+}
 
-   return MDPROTO_STATUS_OK;
+/* Loader has the feature. Loaders without MDPROTO_CMD_HELLO are probed */
+int loader_has(unsigned feature)
+{
+   return !loader_info.valid || (loader_info.hello.features & feature);
 }
 
+int mdproto_ping(int pfd, int timeout_ms)
+{
+   int write_size;
+   int read_status;
+   struct mdproto_cmd_buf_t cmd;
+
+   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_PING, NULL, 0);
+   gpsd_report(LOG_PROG, "PING...\n");
+
+   serialFlush(pfd);
+   usleep(10000);
+   if (write(pfd, (void *)&cmd, write_size) < write_size) {
+      gpsd_report(LOG_PROG, "write() error\n");
+      return -1;
+   }
+
+   read_status = read_mdproto_pkt_tmout(pfd, &cmd, timeout_ms);
+   if (read_status != MDPROTO_STATUS_OK) {
+      gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
+      return -1;
+   }
+
+   if (cmd.data.id != MDPROTO_CMD_PING_RESPONSE) {
+      gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
+      return -1;
+   }
 
+   gpsd_report(LOG_PROG, "PONG...\n");
+   return 0;
+}
 
+/*
+ * Switch loader and tty to the new baud rate. The new rate is confirmed
+ * with PING. If it is not received, the loader returns to the old rate
+ * and so does the host.
+ */
+int mdproto_set_baud(int pfd, struct termios *term, int speed)
+{
+   int i;
+   uint32_t value;
+   struct termios old_term;
+
+   if (baud_constant(speed) == B0) {
+      gpsd_report(LOG_ERROR, "baud rate %d not supported by tty\n", speed);
+      return -1;
+   }
+
+   if (tcgetattr(pfd, &old_term) != 0)
+      return -1;
+
+   value = (uint32_t)speed;
+   if (mdproto_set_param(pfd, MDPROTO_PARAM_BAUD, &value) != 0)
+      return -1;
+
+   if (serialSpeed(pfd, term, speed) == 0) {
+      /* Loader switches after the response has left the UART */
+      usleep(BAUD_SWITCH_DELAY);
+      if (mdproto_ping(pfd, BAUD_PING_TIMEOUT) == 0) {
+	 gpsd_report(LOG_PROG, "link speed %d\n", speed);
+	 return 0;
+      }
+   }
+
+   gpsd_report(LOG_PROG, "baud rate %d failed, falling back\n", speed);
+   while ((tcsetattr(pfd, TCSAFLUSH, &old_term) == -1) && (errno == EINTR));
+   *term = old_term;
+   serialFlush(pfd);
+
+   /* Loader falls back on the first broken request or on read timeout */
+   for (i=0; i < BAUD_FALLBACK_TRIES; i++) {
+      if (mdproto_ping(pfd, BAUD_PING_TIMEOUT) == 0)
+	 break;
+   }
+
+   return -1;
+}
+
+/* Wait for the boot stub response id. Returns its status, -1 on timeout */
+static int mdboot_response(int pfd, uint8_t id, int timeout_ms)
+{
+   struct timespec deadline;
+
+   deadline_init(&deadline, timeout_ms);
+
+   for (;;) {
+      while (rx.len - rx.pos >= 2) {
+	 if (rx.buf[rx.pos] == id) {
+	    rx.pos += 2;
+	    return rx.buf[rx.pos-1];
+	 }
+	 gpsd_report(LOG_RAW, "skip 0x%02x\n", (unsigned)rx.buf[rx.pos]);
+	 rx.pos++;
+      }
+
+      if (deadline_ms_left(&deadline) == 0)
+	 return -1;
+
+      if (rx_fill(pfd, deadline_ms_left(&deadline)) < 0) {
+	 gpsd_report(LOG_PROG, "read() error: %s\n", strerror(errno));
+	 return -1;
+      }
+   }
+}
+
+/*
+ * Switch boot stub and tty to the new baud rate. The rate is confirmed
+ * by the next request: on failure the stub returns to the old rate and
+ * the caller should do the same.
+ */
+int mdboot_set_baud(int pfd, struct termios *term, int speed, int cur_speed)
+{
+   int status;
+   uint8_t req[9];
+
+   if (baud_constant(speed) == B0) {
+      gpsd_report(LOG_ERROR, "baud rate %d not supported by tty\n", speed);
+      return -1;
+   }
+
+   req[0] = MDBOOT_CMD_BAUD;
+   req[1] = (uint8_t)(speed >> 24);
+   req[2] = (uint8_t)(speed >> 16);
+   req[3] = (uint8_t)(speed >> 8);
+   req[4] = (uint8_t)speed;
+   req[5] = (uint8_t)(cur_speed >> 24);
+   req[6] = (uint8_t)(cur_speed >> 16);
+   req[7] = (uint8_t)(cur_speed >> 8);
+   req[8] = (uint8_t)cur_speed;
+
+   serialFlush(pfd);
+   if (write(pfd, req, sizeof(req)) < (ssize_t)sizeof(req)) {
+      gpsd_report(LOG_PROG, "write() error\n");
+      return -1;
+   }
+
+   status = mdboot_response(pfd, MDBOOT_CMD_BAUD_RESPONSE, MDBOOT_RESPONSE_TIMEOUT);
+   if (status != MDBOOT_OK) {
+      gpsd_report(LOG_PROG, "boot stub: baud rate %d not available (%d)\n", speed, status);
+      return -1;
+   }
+
+   if (serialSpeed(pfd, term, speed) != 0)
+      return -1;
+
+   /* Stub switches after the response has left the UART */
+   usleep(BAUD_SWITCH_DELAY);
+
+   return 0;
+}
+
+/*
+ * Send the loader to the boot stub, compressed if it gets smaller.
+ * The stub starts the loader on success.
+ */
+int mdboot_load(int pfd, const uint8_t *loader, size_t ls, int compress, int speed)
+{
+   int status;
+   unsigned data_size, room, chunk_size, pos;
+   uint8_t *buf, *data;
+   struct mdboot_load_t req;
+   struct mdlz_enc_t lz_enc;
+
+   if ((ls == 0) || (ls > MDBOOT_LOAD_MAX_SIZE)) {
+      gpsd_report(LOG_ERROR, "loader size %zu not supported by boot stub\n", ls);
+      return -1;
+   }
+
+   if ((buf = malloc(1 + sizeof(req) + ls)) == NULL) {
+      gpsd_report(LOG_ERROR, "malloc(%zu)\n", 1 + sizeof(req) + ls);
+      return -1;
+   }
+   data = &buf[1 + sizeof(req)];
+
+   req.flags = 0;
+   req.size = htonl((uint32_t)ls);
+   req.crc32 = htonl(mdproto_crc32(0, loader, ls));
+
+   /* Compressed data must be smaller and fit the stub buffer */
+   data_size = 0;
+   if (compress) {
+      room = ls - 1 < MDBOOT_LZ_MAX_SIZE ? (unsigned)ls - 1 : MDBOOT_LZ_MAX_SIZE;
+      mdlz_enc_init(&lz_enc);
+      for (pos = 0; pos < ls; pos += chunk_size) {
+	 chunk_size = (unsigned)ls - pos;
+	 data_size += mdlz_compress(&lz_enc, &loader[pos], &chunk_size, pos,
+	       &data[data_size], room - data_size);
+	 if (chunk_size == 0)
+	    break;
+      }
+      if (pos == ls)
+	 req.flags = MDBOOT_LOAD_LZ;
+   }
+
+   if (!(req.flags & MDBOOT_LOAD_LZ)) {
+      data_size = (unsigned)ls;
+      memcpy(data, loader, ls);
+   }
+   req.data_size = htonl(data_size);
+
+   buf[0] = MDBOOT_CMD_LOAD;
+   memcpy(&buf[1], &req, sizeof(req));
+
+   gpsd_report(LOG_PROG, "boot stub: sending loader, %zu bytes (%u sent)...\n", ls, data_size);
+
+   serialFlush(pfd);
+   if (write(pfd, buf, 1+sizeof(req)+data_size) < (ssize_t)(1+sizeof(req)+data_size)) {
+      gpsd_report(LOG_PROG, "write() error\n");
+      free(buf);
+      return -1;
+   }
+   free(buf);
+
+   status = mdboot_response(pfd, MDBOOT_CMD_LOAD_RESPONSE,
+	 MDBOOT_RESPONSE_TIMEOUT + (int)((1+sizeof(req)+data_size) * 10 * 1000 / (unsigned)speed));
+   if (status != MDBOOT_OK) {
+      gpsd_report(LOG_PROG, "boot stub: loader not started (%d)\n", status);
+      return -1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Command server. Keeps the loader session and runs commands received
+ * over a Unix socket.
+ *
+ * Request: command line, as on the command line, terminated by '\n':
+ *    dump 0x40000000 0x40000fff
+ * Response: "<status> <size>\n" and size bytes of the command output.
+ *    status is 0 if all commands succeed.
+ *
+ * A client may send any number of requests on one connection. Requests
+ * of all clients are run one at a time, in turn. Requests received before
+ * the client closes its end are run, a last line without '\n' too.
+ *
+ * A client must read its responses: a send blocked for SERVER_SEND_TIMEOUT
+ * seconds drops the client, so it does not stall the others.
+ *
+ * Requests can read and write memory and flash, so the socket is created
+ * under umask 077: only the owner of the server may connect.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "flashutils.h"
+
+struct server_client_t {
+   int fd;
+   int eof;  /* client closed its end, runs the queued requests */
+   size_t len;
+   char buf[SERVER_LINE_MAX];
+};
+
+static volatile sig_atomic_t server_stop;
+
+static void server_sighandler(int sig)
+{
+   (void)sig;
+   server_stop = 1;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+   ssize_t cnt;
+   const uint8_t *p = buf;
+
+   while (size != 0) {
+      cnt = write(fd, p, size);
+      if (cnt < 0) {
+	 if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    gpsd_report(LOG_PROG, "client %i: send timeout\n", fd);
+	 return -1;
+      }
+      p += cnt;
+      size -= (size_t)cnt;
+   }
+
+   return 0;
+}
+
+static void client_close(struct server_client_t *c)
+{
+   gpsd_report(LOG_PROG, "client %i closed\n", c->fd);
+   close(c->fd);
+   c->fd = -1;
+   c->eof = 0;
+   c->len = 0;
+}
+
+/* Client closed its end. Closed when the queued requests are run */
+static void client_eof(struct server_client_t *c)
+{
+   if ((c->len != 0) && (c->buf[c->len-1] != '\n') && (c->len < sizeof(c->buf)))
+      c->buf[c->len++] = '\n';
+   c->eof = 1;
+   if (memchr(c->buf, '\n', c->len) == NULL)
+      client_close(c);
+}
+
+/* Run the command line. Command output is collected in out */
+static int run_line(int pfd, struct termios *term, char *line, FILE *out,
+      server_cmd_t cmd)
+{
+   int argc;
+   int res;
+   int stdout_fd;
+   char *argv[SERVER_MAX_ARGS];
+   char *p;
+
+   argc = 0;
+   for (p = strtok(line, " \t\r"); p != NULL; p = strtok(NULL, " \t\r")) {
+      if (argc == SERVER_MAX_ARGS) {
+	 gpsd_report(LOG_ERROR, "too many arguments\n");
+	 return 1;
+      }
+      argv[argc++] = p;
+   }
+
+   /* Commands print to stdout */
+   fflush(stdout);
+   if ((stdout_fd = dup(STDOUT_FILENO)) < 0)
+      return 1;
+   if (dup2(fileno(out), STDOUT_FILENO) < 0) {
+      close(stdout_fd);
+      return 1;
+   }
+
+   res = cmd(pfd, term, argc, argv);
+
+   fflush(stdout);
+   dup2(stdout_fd, STDOUT_FILENO);
+   close(stdout_fd);
+
+   return res;
+}
+
+/* Run one request of the client and send the response */
+static int client_request(int pfd, struct termios *term, struct server_client_t *c,
+      FILE *out, server_cmd_t cmd)
+{
+   int res;
+   char *eol;
+   char hdr[32];
+   char data[4096];
+   size_t line_len;
+   off_t size;
+   ssize_t cnt;
+
+   eol = memchr(c->buf, '\n', c->len);
+   if (eol == NULL)
+      return 0;
+   *eol = '\0';
+   line_len = (size_t)(eol - c->buf) + 1;
+
+   gpsd_report(LOG_PROG, "client %i: %s\n", c->fd, c->buf);
+
+   rewind(out);
+   if (ftruncate(fileno(out), 0) != 0)
+      return -1;
+
+   res = run_line(pfd, term, c->buf, out, cmd);
+
+   memmove(c->buf, &c->buf[line_len], c->len - line_len);
+   c->len -= line_len;
+
+   size = lseek(fileno(out), 0, SEEK_END);
+   if (size < 0)
+      return -1;
+   snprintf(hdr, sizeof(hdr), "%i %lu\n", res, (unsigned long)size);
+   if ((write_all(c->fd, hdr, strlen(hdr)) != 0)
+	 || (lseek(fileno(out), 0, SEEK_SET) != 0))
+      return -1;
+
+   while ((cnt = read(fileno(out), data, sizeof(data))) > 0) {
+      if (write_all(c->fd, data, (size_t)cnt) != 0)
+	 return -1;
+   }
+
+   return cnt < 0 ? -1 : 0;
+}
+
+/*
+ * Serve commands on the Unix socket path until SIGINT or SIGTERM.
+ * The loader session stays open between requests.
+ */
+int server_run(int pfd, struct termios *term, const char *path, server_cmd_t cmd)
+{
+   int sfd;
+   int res;
+   mode_t old_umask;
+   unsigned i, n, next;
+   ssize_t cnt;
+   FILE *out;
+   struct sockaddr_un addr;
+   struct sigaction sa;
+   struct pollfd pfds[SERVER_MAX_CLIENTS+1];
+   struct server_client_t clients[SERVER_MAX_CLIENTS];
+   struct stat sb;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      gpsd_report(LOG_ERROR, "%s: socket name too long\n", path);
+      return 1;
+   }
+   strcpy(addr.sun_path, path);
+
+   if ((out = tmpfile()) == NULL) {
+      gpsd_report(LOG_ERROR, "tmpfile(): %s\n", strerror(errno));
+      return 1;
+   }
+
+   /* Socket left by the previous server */
+   if ((lstat(path, &sb) == 0) && S_ISSOCK(sb.st_mode))
+      unlink(path);
+
+   /* bind() creates the socket owner only */
+   old_umask = umask(077);
+   if (((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	 || (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	 || (listen(sfd, SERVER_MAX_CLIENTS) != 0)) {
+      gpsd_report(LOG_ERROR, "%s: %s\n", path, strerror(errno));
+      umask(old_umask);
+      if (sfd >= 0)
+	 close(sfd);
+      fclose(out);
+      return 1;
+   }
+   umask(old_umask);
+
+   /* Only poll() is interrupted, it checks server_stop */
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = server_sighandler;
+   sa.sa_flags = SA_RESTART;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGPIPE, &sa, NULL);
+
+   for (i=0; i < SERVER_MAX_CLIENTS; i++) {
+      clients[i].fd = -1;
+      clients[i].eof = 0;
+      clients[i].len = 0;
+   }
+
+   gpsd_report(LOG_PROG, "serving commands on %s\n", path);
+
+   res = 0;
+   next = 0;
+   server_stop = 0;
+   while (!server_stop) {
+      /* One queued request per client in turn */
+      for (n=0; n < SERVER_MAX_CLIENTS; n++) {
+	 i = (next + n) % SERVER_MAX_CLIENTS;
+	 if ((clients[i].fd >= 0) && (memchr(clients[i].buf, '\n', clients[i].len) != NULL))
+	    break;
+      }
+      if (n != SERVER_MAX_CLIENTS) {
+	 if (client_request(pfd, term, &clients[i], out, cmd) != 0)
+	    client_close(&clients[i]);
+	 else if (clients[i].eof && (memchr(clients[i].buf, '\n', clients[i].len) == NULL))
+	    client_close(&clients[i]);
+	 next = (i + 1) % SERVER_MAX_CLIENTS;
+	 /* Let other clients queue their requests */
+      }
+
+      pfds[0].fd = sfd;
+      pfds[0].events = POLLIN;
+      for (i=0; i < SERVER_MAX_CLIENTS; i++) {
+	 pfds[i+1].fd = clients[i].eof ? -1 : clients[i].fd;
+	 pfds[i+1].events = POLLIN;
+	 pfds[i+1].revents = 0;
+      }
+
+      if (poll(pfds, SERVER_MAX_CLIENTS+1, n != SERVER_MAX_CLIENTS ? 0 : -1) < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 gpsd_report(LOG_ERROR, "poll(): %s\n", strerror(errno));
+	 res = 1;
+	 break;
+      }
+
+      if (pfds[0].revents & POLLIN) {
+	 int fd = accept(sfd, NULL, NULL);
+	 if (fd >= 0) {
+	    for (i=0; (i < SERVER_MAX_CLIENTS) && (clients[i].fd >= 0); i++);
+	    if (i == SERVER_MAX_CLIENTS) {
+	       gpsd_report(LOG_PROG, "too many clients\n");
+	       close(fd);
+	    }else {
+	       struct timeval tv;
+
+	       tv.tv_sec = SERVER_SEND_TIMEOUT;
+	       tv.tv_usec = 0;
+	       setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	       gpsd_report(LOG_PROG, "client %i connected\n", fd);
+	       clients[i].fd = fd;
+	       clients[i].eof = 0;
+	       clients[i].len = 0;
+	    }
+	 }
+      }
+
+      for (i=0; i < SERVER_MAX_CLIENTS; i++) {
+	 struct server_client_t *c = &clients[i];
+
+	 if ((c->fd < 0) || c->eof
+	       || !(pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR)))
+	    continue;
+	 if (c->len == sizeof(c->buf)) {
+	    /* Waits until the queued requests are run */
+	    if (memchr(c->buf, '\n', c->len) != NULL)
+	       continue;
+	    gpsd_report(LOG_PROG, "client %i: line too long\n", c->fd);
+	    client_close(c);
+	    continue;
+	 }
+	 cnt = read(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len);
+	 if (cnt > 0)
+	    c->len += (size_t)cnt;
+	 else if (cnt == 0)
+	    client_eof(c);
+	 else
+	    client_close(c);
+      }
+   }
+
+   for (i=0; i < SERVER_MAX_CLIENTS; i++) {
+      if (clients[i].fd >= 0)
+	 client_close(&clients[i]);
+   }
+   close(sfd);
+   unlink(path);
+   fclose(out);
+
+   sa.sa_handler = SIG_DFL;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   gpsd_report(LOG_PROG, "server stopped\n");
+   return res;
+}
@@ -16,6 +16,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,12 +36,46 @@
 #include <unistd.h>
 
 #include "flashutils.h"
+#include "arm/include/mdboot.h"
 #include "arm/include/mdproto.h"
 
 const char *progname = "sirfmemdump";
 const char *revision = "$Revision: 0.3 $";
 static int verbosity = 3;
 
+/* Loader and link settings */
+static struct {
+   const char *lname;
+   /* boot stub, "" - loader is sent through the boot ROM */
+   const char *bname;
+   int inject_loader;
+   int switch_from_sirf;
+   unsigned window;
+   int speed;
+   unsigned fcs;
+   unsigned mtu;
+   int compress;
+   /* current link speed */
+   int cur_speed;
+   /* highest boot ROM boost to try */
+   int rom_boost;
+} link_cfg = {
+   DEFAULT_LOADER,
+   DEFAULT_BOOT_STUB,
+   1,
+   1,
+   DEFAULT_WINDOW,
+   DEFAULT_LINK_SPEED,
+   DEFAULT_FCS,
+   DEFAULT_MTU,
+   1,
+   LOADER_SPEED,
+   BOOST_115200
+};
+
+static int link_setup(int pfd, struct termios *term);
+static int link_reinject(int pfd, struct termios *term);
+
 void gpsd_report(int errlevel, const char *fmt, ... )
 /* assemble command in printf(3) style, use stderr or syslog */
 {
@@ -59,7 +95,7 @@ void gpsd_report(int errlevel, const char *fmt, ... )
 
 static void
 usage(void){
-   fprintf(stderr, "Usage: %s [-v d] [-l <loader_file>] [ -p tty ] [-n] command\n", progname);
+   fprintf(stderr, "Usage: %s [-v d] [-l <loader_file>] [-s <stub_file>] [ -p tty ] [-w credits] [-b baud] [-c fcs] [-m mtu] [-Z] [-o file] [-n] [-d socket] command\n", progname);
 }
 
 static void version(void)
@@ -77,8 +113,19 @@ static void help(void)
    "\nOptions:\n"
    "    -p  <tty>,     Serial port, default: " DEFAULT_PORT "\n"
    "    -l, <loader>   Injected loader, default: " DEFAULT_LOADER "\n"
-   "    -n,            Do not inject loader\n"
-   "    -i,            Do not switch from sirf to internal boot mode\n"
+   "    -s  <stub>,    Boot stub loading the loader at link speed, \"\" - none.\n"
+   "                   Default: " DEFAULT_BOOT_STUB "\n"
+   "    -n,            Do not inject loader. Without -n and -i a running\n"
+   "                   compatible loader is reused\n"
+   "    -w  <credits>, Number of pipelined requests, 0 - stop-and-wait. Default: %u\n"
+   "    -b  <baud>,    Loader link speed, up to 921600. Default: %u\n"
+   "    -c  <fcs>,     Frame check: sum, crc16, crc32. Default: crc32\n"
+   "    -m  <mtu>,     Maximum frame data size, %u-%u. Default: %u\n"
+   "    -Z,            Do not compress transfers\n"
+   "    -o  <file>,    Dump to sparse file. Interrupted dump is resumed\n"
+   "    -d  <socket>,  Keep the loader and serve commands on the Unix socket\n"
+   "    -i,            Do not switch from sirf to internal boot mode, always\n"
+   "                   inject the loader\n"
    "    -v,            Verbosity level \n"
    "    -h,            Help\n"
    "    -V,            Show version\n"
@@ -90,59 +137,157 @@ static void help(void)
    "    erase-sector {flash_addr}            Erase flash sector\n"
    "    program-word {flash_addr} {word}     Program one word\n"
    "    program {file}                       Program flash\n"
-   "\n"
+   "\n",
+   DEFAULT_WINDOW, DEFAULT_LINK_SPEED,
+   MDPROTO_CMD_MAX_RAW_DATA_SIZE, MDPROTO_MTU_MAX, DEFAULT_MTU
  );
  return;
 }
 
 
-int inject_loader(int pfd, struct termios *term, const char *lname, int switch_from_sirf)
+/* Read the whole file. Returns malloc()ed buffer */
+static void *read_file(const char *fname, size_t *size)
 {
-   const char wait_result[]="+++";
-   int lfd;
-   size_t ls;
-   void *loader;
-   sigset_t sigset;
+   int fd;
+   void *buf;
    struct stat sb;
 
-  /* there may be a type-specific setup method */
-  if(sirfSetProto(pfd, term, 38400, PROTO_SIRF) == -1) {
-     gpsd_report(LOG_ERROR, "port_setup()\n");
+   if((fd = open(fname, O_RDONLY)) == -1) {
+      gpsd_report(LOG_ERROR, "open(%s): %s\n", fname, strerror(errno));
+      return NULL;
+   }
+
+   /* fstat() its file descriptor. Need the size, and avoid races */
+   if(fstat(fd, &sb) == -1) {
+      gpsd_report(LOG_ERROR, "fstat(%s): %s\n", fname, strerror(errno));
+      (void)close(fd);
+      return NULL;
+   }
+
+   *size = (size_t)sb.st_size;
+
+   if ((buf = malloc(*size)) == NULL) {
+      gpsd_report(LOG_ERROR, "malloc(%zd)\n", *size);
+      (void)close(fd);
+      return NULL;
+   }
+
+   if (read_full(fd, buf, *size) != (ssize_t)*size) {
+      (void)free(buf);
+      (void)close(fd);
+      gpsd_report(LOG_ERROR, "read(%zd)\n", *size);
+      return NULL;
+   }
+
+   /* don't care if close fails - kernel will force close on exit() */
+   (void)close(fd);
+
+   return buf;
+}
+
+/*
+ * Boot stub is running at link_cfg.cur_speed: raise the baud rate and send
+ * the loader. The loader is sent at the current rate if the new rate fails
+ */
+static int boot_stub_load(int pfd, struct termios *term, const void *loader, size_t ls)
+{
+  struct termios old_term;
+
+  if (tcgetattr(pfd, &old_term) != 0)
      return 1;
-  }
 
-  gpsd_report(LOG_PROG, "port set up...\n");
+  if ((link_cfg.speed != link_cfg.cur_speed)
+	&& (mdboot_set_baud(pfd, term, link_cfg.speed, link_cfg.cur_speed) == 0)) {
+     if (mdboot_load(pfd, loader, ls, link_cfg.compress, link_cfg.speed) == 0) {
+	link_cfg.cur_speed = link_cfg.speed;
+	return 0;
+     }
 
-  /* Open the loader file */
-  if((lfd = open(lname, O_RDONLY)) == -1) {
-      gpsd_report(LOG_ERROR, "open(%s): %s\n", lname, strerror(errno));
-      return 1;
+     /* Stub returns to the old rate on the broken request */
+     gpsd_report(LOG_PROG, "baud rate %d failed, falling back\n", link_cfg.speed);
+     while ((tcsetattr(pfd, TCSAFLUSH, &old_term) == -1) && (errno == EINTR));
+     *term = old_term;
+     serialFlush(pfd);
   }
 
-  /* fstat() its file descriptor. Need the size, and avoid races */
-  if(fstat(lfd, &sb) == -1) {
-      gpsd_report(LOG_ERROR, "fstat(%s): %s\n", lname, strerror(errno));
-      return 1;
-  }
+  if (mdboot_load(pfd, loader, ls, link_cfg.compress, link_cfg.cur_speed) != 0)
+     return 1;
 
-  gpsd_report(LOG_PROG, "passed sanity checks...\n");
+  return 0;
+}
 
-  ls = (size_t)sb.st_size;
+/*
+ * Send the image through the boot ROM and wait for its banner. The
+ * highest boot ROM boost not above the link speed is used. A failed
+ * boosted transfer leaves the ROM in an unknown state: it is not retried,
+ * the receiver needs a power cycle. Sets link_cfg.cur_speed
+ */
+static int rom_send(int pfd, struct termios *term, char *image, size_t size,
+      const char *banner, time_t timeout)
+{
+  int boost, speed;
 
-  /* malloc a loader buffer */
-  if ((loader = malloc(ls)) == NULL) {
-      gpsd_report(LOG_ERROR, "malloc(%zd)\n", ls);
-      return 1;
+  boost = link_cfg.rom_boost;
+  while ((boost > BOOST_38400)
+	&& ((sirfBoostSpeed(boost) == -1) || (sirfBoostSpeed(boost) > link_cfg.speed)))
+     boost--;
+
+  speed = sirfBoostSpeed(boost);
+  gpsd_report(LOG_PROG, "boot ROM transfer at %d baud\n", speed);
+  if (sirfSendLoader(pfd, term, image, size, boost) == -1)
+     return 1;
+
+  if (expect(pfd, banner, strlen(banner),
+	   boost == BOOST_38400 ? timeout : ROM_BOOST_TIMEOUT) == 0) {
+     if (boost != BOOST_38400)
+	gpsd_report(LOG_ERROR, "boot ROM transfer at %d baud failed. "
+	      "Power cycle the receiver and retry with -b %d\n",
+	      speed, sirfBoostSpeed(boost - 1));
+     return 1;
   }
 
-  if (read_full(lfd, loader, ls) != (ssize_t)ls) {
-      (void)free(loader);
-      gpsd_report(LOG_ERROR, "read(%zd)\n", ls);
-      return 1;
+  link_cfg.cur_speed = speed;
+  return 0;
+}
+
+int inject_loader(int pfd, struct termios *term, const char *lname, int switch_from_sirf)
+{
+   const char wait_result[]="+++";
+   int res;
+   size_t ls, ss;
+   void *loader, *stub;
+   sigset_t sigset;
+
+  /* Boot ROM is silent and does not need the receiver setup */
+  if (!switch_from_sirf) {
+     if (serialConfig(pfd, term, 38400) == -1) {
+	gpsd_report(LOG_ERROR, "port_setup()\n");
+	return 1;
+     }
+  }else if (sirfDetectSetProto(pfd, term, 38400, PROTO_SIRF) != 0) {
+     gpsd_report(LOG_PROG, "receiver not detected, configuring at all rates\n");
+     /* there may be a type-specific setup method */
+     if(sirfSetProto(pfd, term, 38400, PROTO_SIRF) == -1) {
+	gpsd_report(LOG_ERROR, "port_setup()\n");
+	return 1;
+     }
   }
 
-  /* don't care if close fails - kernel will force close on exit() */
-  (void)close(lfd);
+  gpsd_report(LOG_PROG, "port set up...\n");
+
+  if ((loader = read_file(lname, &ls)) == NULL)
+     return 1;
+
+  stub = NULL;
+  if (*link_cfg.bname != '\0') {
+     if ((stub = read_file(link_cfg.bname, &ss)) == NULL)
+	gpsd_report(LOG_PROG, "no boot stub, loader is sent through the boot ROM\n");
+     else if (ls > MDBOOT_LOAD_MAX_SIZE) {
+	gpsd_report(LOG_PROG, "loader too big for boot stub, sent through the boot ROM\n");
+	(void)free(stub);
+	stub = NULL;
+     }
+  }
 
   gpsd_report(LOG_PROG, "loader read in...\n");
 
@@ -159,6 +304,7 @@ int inject_loader(int pfd, struct termios *term, const char *lname, int switch_f
 
   if(sigprocmask(SIG_BLOCK, &sigset, NULL) == -1) {
 	  (void)free(loader);
+	  (void)free(stub);
 	  gpsd_report(LOG_ERROR,"sigprocmask\n");
 	  return 1;
   }
@@ -167,18 +313,35 @@ int inject_loader(int pfd, struct termios *term, const char *lname, int switch_f
      gpsd_report(LOG_PROG, "Switching to internal boot mode...\n");
      if (sirfEnterInternalBootMode(pfd) == -1) {
 	(void)free(loader);
+	(void)free(stub);
 	gpsd_report(LOG_ERROR, "sirfEnterInternalBootmode() error \n");
 	return 1;
      }
   }
 
-  gpsd_report(LOG_PROG, "Sending loader...\n");
+  if (stub != NULL) {
+     /* Boot ROM loads the stub, the stub loads the loader */
+     gpsd_report(LOG_PROG, "Sending boot stub...\n");
+     if (rom_send(pfd, term, stub, ss, MDBOOT_READY, MDBOOT_READY_TIMEOUT) != 0) {
+	gpsd_report(LOG_PROG, "No response from boot stub\n");
+	res = 1;
+     }else {
+	gpsd_report(LOG_PROG, "Boot stub launched\n");
+	res = boot_stub_load(pfd, term, loader, ls);
+	if ((res == 0)
+	      && (expect(pfd, wait_result, strlen(wait_result), LOADER_BANNER_TIMEOUT) == 0)) {
+	   gpsd_report(LOG_PROG, "No response from loader\n");
+	   res = 1;
+	}
+     }
+     (void)free(stub);
+  }else {
+     gpsd_report(LOG_PROG, "Sending loader...\n");
 
-  /* send the bootstrap/flash programmer */
-  if (sirfSendLoader(pfd, term, loader, ls) == -1) {
-     (void)free(loader);
-     gpsd_report(LOG_ERROR, "Loader send\n");
-     return 1;
+     /* send the bootstrap/flash programmer */
+     res = rom_send(pfd, term, loader, ls, wait_result, LOADER_BANNER_TIMEOUT);
+     if (res != 0)
+	gpsd_report(LOG_PROG, "No response from loader\n");
   }
   (void)free(loader);
 
@@ -189,49 +352,73 @@ int inject_loader(int pfd, struct termios *term, const char *lname, int switch_f
 	  return 1;
   }
 
-  /* sirfSetProto(pfd, &term, PROTO_NMEA, 4800); */
-  gpsd_report(LOG_PROG, "Finished.\n");
-
-  if (expect(pfd, wait_result, strlen(wait_result), 30) != 0) {
-     gpsd_report(LOG_PROG, "Loader successfully launched\n");
-  }else {
-     gpsd_report(LOG_PROG, "No response from loader\n");
+  if (res != 0) {
+     gpsd_report(LOG_ERROR, "Loader send\n");
      return 1;
   }
 
+  /* sirfSetProto(pfd, &term, PROTO_NMEA, 4800); */
+  gpsd_report(LOG_PROG, "Loader successfully launched at %d baud\n", link_cfg.cur_speed);
+
   return 0;
 }
 
 
-int cmd_ping(int pfd)
+/*
+ * Loader left running by the previous invocation. It is reused if it
+ * answers PING at the boot ROM or link rate and HELLO shows the build in
+ * the loader file. Sets link_cfg.cur_speed. Not used with -i: the
+ * receiver is in the boot ROM then and PING would confuse it
+ */
+static int loader_reuse(int pfd, struct termios *term)
 {
-  unsigned read_status;
-  int write_size;
-  struct mdproto_cmd_buf_t cmd;
-
-  write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_PING, NULL, 0);
-  gpsd_report(LOG_PROG, "PING...\n");
-
-  tcflush(pfd, TCIOFLUSH);
-  usleep(10000);
-  if (write(pfd, (void *)&cmd, write_size) < write_size) {
-     gpsd_report(LOG_PROG, "write() error\n");
-     return 1;
+  int i, speed;
+  size_t ls;
+  void *loader;
+  int res;
+
+  if (serialConfig(pfd, term, LOADER_SPEED) == -1)
+     return 0;
+
+  speed = LOADER_SPEED;
+  for (i=0;; i++) {
+     if (mdproto_ping(pfd, REUSE_PING_TIMEOUT) == 0)
+	break;
+     /* Previous invocation did not restore the rate */
+     if ((i != 0) || (link_cfg.speed == LOADER_SPEED)
+	   || (serialSpeed(pfd, term, link_cfg.speed) != 0))
+	return 0;
+     speed = link_cfg.speed;
   }
 
-  read_status = read_mdproto_pkt(pfd, &cmd);
-  if (read_status != MDPROTO_STATUS_OK) {
-     gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
-     return 1;
+  if ((mdproto_hello(pfd) != 0)
+	|| (loader_info.hello.proto_version != MDPROTO_VERSION)) {
+     gpsd_report(LOG_PROG, "running loader is not compatible\n");
+     return 0;
   }
 
-  if (cmd.data.id != MDPROTO_CMD_PING_RESPONSE) {
-     gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
-     return 1;
+  /* Version string is embedded in the loader. Running loader is not
+   * verified if the loader file can not be read */
+  res = 0;
+  if ((loader = read_file(link_cfg.lname, &ls)) != NULL) {
+     res = memmem(loader, ls, loader_info.hello.version,
+	   strlen((const char *)loader_info.hello.version)+1) != NULL;
+     (void)free(loader);
+  }
+  if (!res) {
+     gpsd_report(LOG_PROG, "running loader `%s` does not match %s\n",
+	   loader_info.hello.version, link_cfg.lname);
+     return 0;
   }
 
-  gpsd_report(LOG_PROG, "PONG...\n");
-  return 0;
+  gpsd_report(LOG_PROG, "reusing running loader at %d baud\n", speed);
+  link_cfg.cur_speed = speed;
+  return 1;
+}
+
+int cmd_ping(int pfd)
+{
+  return mdproto_ping(pfd, MDPROTO_READ_TIMEOUT) == 0 ? 0 : 1;
 }
 
 int cmd_exec(int pfd, unsigned f_addr, unsigned r0, unsigned r1, unsigned r2, unsigned r3)
@@ -264,7 +451,7 @@ int cmd_exec(int pfd, unsigned f_addr, unsigned r0, unsigned r1, unsigned r2, un
   write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_EXEC_CODE, &req, sizeof(req));
   gpsd_report(LOG_PROG, "EXECUTE...\n");
 
-  tcflush(pfd, TCIOFLUSH);
+  serialFlush(pfd);
   if (write(pfd, (void *)&cmd, write_size) < write_size) {
      gpsd_report(LOG_PROG, "write() error\n");
      return 1;
@@ -287,7 +474,7 @@ int cmd_exec(int pfd, unsigned f_addr, unsigned r0, unsigned r1, unsigned r2, un
   resp = (struct resp_t *)&cmd.data.p[1];
 
   /* XXX: byteorder  */
-  gpsd_report(LOG_PROG, "R0: %08x R1: %08x R2: %08x R3: %08x\n",
+  printf("R0: %08x R1: %08x R2: %08x R3: %08x\n",
 	(unsigned)resp->r0,
 	(unsigned)resp->r1,
 	(unsigned)resp->r2,
@@ -297,114 +484,310 @@ int cmd_exec(int pfd, unsigned f_addr, unsigned r0, unsigned r1, unsigned r2, un
 }
 
 
-int cmd_dump(int pfd, unsigned src_addr, unsigned dst_addr)
+static int dump_to_stdout(void *ctx, unsigned addr, const uint8_t *data, unsigned size)
 {
-  unsigned read_status;
-  int write_size;
-  int cur_size;
-  struct mdproto_cmd_buf_t cmd;
-  struct {
-     uint32_t src;
-     uint32_t dst;
-  } __attribute__((packed)) req;
+  (void)ctx;
+  (void)addr;
+
+  if (write(STDOUT_FILENO, data, size) < (ssize_t)size) {
+     gpsd_report(LOG_PROG, "write() to stdout error\n");
+     return 1;
+  }
 
+  return 0;
+}
 
-  req.src = htonl(src_addr);
-  req.dst = htonl(dst_addr);
-  write_size = mdproto_pkt_init(&cmd, MDPROTO_CMD_MEM_READ, &req, sizeof(req));
-  gpsd_report(LOG_PROG, "MEM_READ...\n");
+struct dump_file_ctx_t {
+   int fd;
+   unsigned src_addr;
+   unsigned dst_addr;
+   /* Block being received. Blocks are written when complete */
+   unsigned blk_addr;
+   unsigned blk_size;
+   uint8_t blk[JOURNAL_BLOCK_SIZE];
+   struct dump_journal_t journal;
+};
+
+static int is_zero_block(const uint8_t *data, unsigned size)
+{
+  unsigned i;
 
-  tcflush(pfd, TCIOFLUSH);
-  usleep(10000);
-  if (write(pfd, (void *)&cmd, write_size) < write_size) {
-     gpsd_report(LOG_PROG, "write() error\n");
+  for (i = 0; i < size; i++)
+     if (data[i] != 0)
+	return 0;
+  return 1;
+}
+
+/* Write the current block. All-zero blocks are left as holes */
+static int dump_file_flush(struct dump_file_ctx_t *f)
+{
+  off_t offset;
+  unsigned mark_addr;
+
+  offset = (off_t)(f->blk_addr - f->src_addr);
+  if (is_zero_block(f->blk, f->blk_size)) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+     if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	      offset, f->blk_size) == 0)
+	goto done;
+#endif
+  }
+
+  if (pwrite(f->fd, f->blk, f->blk_size, offset) < (ssize_t)f->blk_size) {
+     gpsd_report(LOG_PROG, "write() error: %s\n", strerror(errno));
      return 1;
   }
 
-  while (src_addr <= dst_addr) {
-     gpsd_report(LOG_RAW, "0x%x...\n", src_addr);
-     read_status = read_mdproto_pkt(pfd, &cmd);
-     if (read_status != MDPROTO_STATUS_OK) {
-	gpsd_report(LOG_PROG, "read_mdproto_pkt() error `%c`\n", read_status);
-	return 1;
+#ifdef FALLOC_FL_PUNCH_HOLE
+done:
+#endif
+  mark_addr = f->blk_addr;
+  f->blk_addr += f->blk_size;
+  f->blk_size = 0;
+  return journal_mark(&f->journal, &mark_addr, f->blk_addr - 1) != 0;
+}
+
+static int dump_to_file(void *ctx, unsigned addr, const uint8_t *data, unsigned size)
+{
+  unsigned blk_last;
+  unsigned cur_size;
+  struct dump_file_ctx_t *f;
+
+  f = (struct dump_file_ctx_t *)ctx;
+
+  /* New range from the journal starts at a block boundary */
+  if (addr != f->blk_addr + f->blk_size) {
+     f->blk_addr = addr;
+     f->blk_size = 0;
+  }
+
+  while (size != 0) {
+     blk_last = f->blk_addr + JOURNAL_BLOCK_SIZE - 1;
+     if ((blk_last < f->blk_addr) || (blk_last > f->dst_addr))
+	blk_last = f->dst_addr;
+
+     cur_size = blk_last - f->blk_addr + 1 - f->blk_size;
+     if (cur_size > size)
+	cur_size = size;
+     memcpy(&f->blk[f->blk_size], data, cur_size);
+     f->blk_size += cur_size;
+     data += cur_size;
+     size -= cur_size;
+
+     if (f->blk_addr + f->blk_size - 1 == blk_last) {
+	if (dump_file_flush(f) != 0)
+	   return 1;
      }
-     if (cmd.data.id != MDPROTO_CMD_MEM_READ_RESPONSE) {
-	gpsd_report(LOG_PROG, "received wrong response code `0x%x`\n", cmd.data.id);
-	return 1;
+  }
+
+  return 0;
+}
+
+/* Set size of the new dump file and reserve space for it */
+static int dump_file_alloc(struct dump_file_ctx_t *f)
+{
+  off_t size;
+
+  size = (off_t)(f->dst_addr - f->src_addr) + 1;
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(f->fd, 0, 0, size) == 0)
+     return 0;
+  gpsd_report(LOG_PROG, "fallocate() error: %s\n", strerror(errno));
+#endif
+  if (ftruncate(f->fd, size) != 0) {
+     gpsd_report(LOG_ERROR, "ftruncate() error: %s\n", strerror(errno));
+     return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Dump to file. Each block is written at its offset, so ranges may be
+ * dumped in any order. All-zero blocks are left as holes in the sparse
+ * file. Completed blocks are recorded in the journal, so an interrupted
+ * dump is resumed from where it stopped. When the loader stops
+ * responding it is injected again.
+ */
+static int dump_file(int pfd, struct termios *term,
+      unsigned src_addr, unsigned dst_addr, const char *fname)
+{
+  int res;
+  int resumed;
+  unsigned from, to;
+  unsigned reinjects;
+  static struct dump_file_ctx_t f;
+
+  resumed = journal_open(&f.journal, fname, src_addr, dst_addr);
+  if (resumed < 0)
+     return 1;
+
+  f.fd = open(fname, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+  if (f.fd < 0) {
+     gpsd_report(LOG_ERROR, "open(%s): %s\n", fname, strerror(errno));
+     journal_close(&f.journal, 0);
+     return 1;
+  }
+  f.src_addr = src_addr;
+  f.dst_addr = dst_addr;
+  f.blk_addr = src_addr;
+  f.blk_size = 0;
+  if (resumed)
+     gpsd_report(LOG_PROG, "resuming dump to %s\n", fname);
+  else if (dump_file_alloc(&f) != 0) {
+     close(f.fd);
+     journal_close(&f.journal, 0);
+     return 1;
+  }
+
+  res = 0;
+  reinjects = 0;
+  from = src_addr;
+  while (journal_next(&f.journal, &from, &to)) {
+     gpsd_report(LOG_PROG, "0x%x - 0x%x...\n", from, to);
+     if (dump_mem_range(pfd, from, to, dump_to_file, &f) == 0)
+	continue;
+
+     if (!link_cfg.inject_loader || (reinjects++ >= DUMP_MAX_REINJECTS)) {
+	res = 1;
+	break;
      }
-     cur_size = ntohs(cmd.size) - 1;
-     if (write (STDOUT_FILENO, &cmd.data.p[1], cur_size) < cur_size) {
-	gpsd_report(LOG_PROG, "write() to stdout error\n");
-	return 1;
+     gpsd_report(LOG_PROG, "re-injecting loader...\n");
+     if (link_reinject(pfd, term) != 0) {
+	res = 1;
+	break;
      }
-     src_addr += cur_size;
+     /* journal_next() starts from the first unfinished block */
+     from = src_addr;
   }
 
+  close(f.fd);
+  journal_close(&f.journal, res == 0);
+
+  return res;
+}
+
+int cmd_dump(int pfd, struct termios *term,
+      unsigned src_addr, unsigned dst_addr, const char *fname)
+{
+  gpsd_report(LOG_PROG, "MEM_READ...\n");
+
+  if (fname != NULL) {
+     if (dump_file(pfd, term, src_addr, dst_addr, fname) != 0)
+	return 1;
+  }else if (dump_mem_range(pfd, src_addr, dst_addr, dump_to_stdout, NULL) != 0)
+     return 1;
+
   gpsd_report(LOG_PROG, "DONE\n");
   return 0;
 }
 
+/* Loader can switch to the rate. Unknown UART clock is not checked */
+static int link_speed_available(int speed)
+{
+  unsigned clk, div, real;
 
-int
-main(int argc, char **argv){
+  if (!loader_info.valid || (loader_info.hello.uart_clock == 0))
+     return 1;
 
-	int ch;
-	int pfd;
-	int do_inject_loader = 1;
-	int do_switch_from_sirf = 1;
-	int res = 0;
-	int argnum;
-	char *lname = DEFAULT_LOADER;
-	char *port = DEFAULT_PORT;
-	struct termios term;
+  clk = loader_info.hello.uart_clock;
+  div = (clk + (unsigned)speed / 2) / (unsigned)speed;
+  if ((div == 0) || (div > 0x10000))
+     return 0;
 
-	progname = argv[0];
+  real = clk / div;
+  if (real > (unsigned)speed)
+     return (real - (unsigned)speed) * 100 <= (unsigned)speed * LINK_BAUD_TOLERANCE;
+  return ((unsigned)speed - real) * 100 <= (unsigned)speed * LINK_BAUD_TOLERANCE;
+}
 
-	while ((ch = getopt(argc, argv, "l:Vv:p:ni")) != -1)
-		switch (ch) {
-		case 'l':
-			lname = optarg;
-			break;
-		case 'p':
-			port = optarg;
-			break;
-		case 'v':
-			verbosity = atoi(optarg);
-			break;
-	        case 'n':
-			do_inject_loader = 0;
-			break;
-	        case 'i':
-			do_switch_from_sirf = 0;
-			break;
-		case 'V':
-			version();
-			exit(0);
-		default:
-			help();
-			exit(0);
-			/* NOTREACHED */
-		}
+/* Negotiate link settings with the freshly started loader */
+static int link_setup(int pfd, struct termios *term)
+{
+  int rate_known = 1;
+
+  /* Loader assumes the boot ROM rate. Its UART clock is wrong after
+   * the boot ROM boost */
+  if (link_cfg.cur_speed != LOADER_SPEED) {
+     uint32_t value = link_cfg.cur_speed;
+     if (mdproto_set_param(pfd, MDPROTO_PARAM_CUR_BAUD, &value) != 0) {
+	gpsd_report(LOG_PROG, "loader does not know it runs at %d baud\n", link_cfg.cur_speed);
+	rate_known = 0;
+     }
+  }
 
-	argc -= optind;
-	argv += optind;
+  mdproto_hello(pfd);
 
-	/* Open the serial port, blocking is OK */
-	if((pfd = open(port, O_RDWR | O_NOCTTY , 0600)) == -1) {
-		gpsd_report(LOG_ERROR, "open(%s) failed: %s\n", port, strerror(errno));
-		return 1;
-	}
+  /* Stronger frame check before speeding up the link */
+  if ((link_cfg.fcs != MDPROTO_FCS_SUM8) && loader_has(MDPROTO_FEATURE_FCS)) {
+     uint32_t value = link_cfg.fcs;
+     if (mdproto_set_param(pfd, MDPROTO_PARAM_FCS, &value) != 0)
+	gpsd_report(LOG_PROG, "frame check %u not available\n", link_cfg.fcs);
+  }
 
-	memset(&term, 0, sizeof(term));
+  if ((link_cfg.speed != link_cfg.cur_speed)
+	&& (!rate_known || !loader_has(MDPROTO_FEATURE_BAUD)
+	   || !link_speed_available(link_cfg.speed)))
+     gpsd_report(LOG_PROG, "%d baud not available, staying at %d baud\n",
+	   link_cfg.speed, link_cfg.cur_speed);
+  else if (link_cfg.speed != link_cfg.cur_speed) {
+     if (mdproto_set_baud(pfd, term, link_cfg.speed) == 0)
+	link_cfg.cur_speed = link_cfg.speed;
+     else
+	gpsd_report(LOG_PROG, "staying at %d baud\n", link_cfg.cur_speed);
+  }
 
-	if (do_inject_loader) {
-	   res = inject_loader(pfd, &term, lname, do_switch_from_sirf);
-	   if (res != 0)
-	      goto end;
-	}
+  /* Window depends on the frame size */
+  if ((link_cfg.mtu != mdproto_link.mtu) && loader_has(MDPROTO_FEATURE_MTU)) {
+     uint32_t mtu = link_cfg.mtu;
+     if (loader_info.valid && (mtu > loader_info.hello.mtu_max))
+	mtu = loader_info.hello.mtu_max;
+     if ((mtu != mdproto_link.mtu)
+	   && (mdproto_set_param(pfd, MDPROTO_PARAM_MTU, &mtu) != 0))
+	gpsd_report(LOG_PROG, "frame size %u not available\n", link_cfg.mtu);
+  }
+
+  if ((link_cfg.window != 0) && loader_has(MDPROTO_FEATURE_WINDOW)) {
+     uint32_t credits = link_cfg.window;
+     if (mdproto_set_param(pfd, MDPROTO_PARAM_WINDOW, &credits) != 0)
+	gpsd_report(LOG_PROG, "window mode not available\n");
+  }
+
+  if (link_cfg.compress) {
+     dump_lz_probe(pfd);
+     flash_lz_probe(pfd);
+  }
+
+  return 0;
+}
+
+/* Inject the loader again and start from the default link settings */
+static int link_reinject(int pfd, struct termios *term)
+{
+  mdproto_link.window = 0;
+  mdproto_link.fcs = MDPROTO_FCS_SUM8;
+  mdproto_link.mtu = MDPROTO_CMD_MAX_RAW_DATA_SIZE;
+  mdproto_link.seq = 0;
+  link_cfg.cur_speed = LOADER_SPEED;
+  loader_info.valid = 0;
+
+  if (inject_loader(pfd, term, link_cfg.lname, link_cfg.switch_from_sirf) != 0)
+     return 1;
+
+  return link_setup(pfd, term);
+}
+
+
+
+/* Run the command list. Returns 0 if all commands succeed */
+static int
+run_commands(int pfd, struct termios *term, int argc, char **argv, const char *out_fname){
+	int res = 0;
+	int argnum;
 
 	argnum=0;
 	while (argnum < argc) {
+	   res = 1;
 	   if (strcasecmp(argv[argnum], "ping") == 0) {
 	      argnum++;
 	      res = cmd_ping(pfd);
@@ -414,7 +797,7 @@ main(int argc, char **argv){
 	      unsigned long src_addr, dst_addr;
 	      char *endptr;
 
-	      if ((argc < 3)
+	      if ((argc - argnum < 3)
 		    || (*argv[argnum+1]=='\0')
 		    || (*argv[argnum+2]=='\0') ) {
 		 gpsd_report(LOG_ERROR, "src_addr/dst_addr not defined\n");
@@ -423,19 +806,19 @@ main(int argc, char **argv){
 
 	      src_addr = strtoul(argv[argnum+1], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "src_addr", argv[argc+1]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "src_addr", argv[argnum+1]);
 		 break;
 	      }
 	      dst_addr = strtoul(argv[argnum+2], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "dst_addr", argv[argc+2]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "dst_addr", argv[argnum+2]);
 		 break;
 	      }
 	      if (dst_addr < src_addr) {
 		 gpsd_report(LOG_ERROR, "dst_addr < src_addr\n");
 		 break;
 	      }
-	      res = cmd_dump(pfd, src_addr, dst_addr);
+	      res = cmd_dump(pfd, term, src_addr, dst_addr, out_fname);
 	      if (res != 0)
 		 break;
 	      argnum += 3;
@@ -447,7 +830,7 @@ main(int argc, char **argv){
 	      unsigned long tmp;
 	      unsigned i_err;
 
-	      if ((argc < 6)
+	      if ((argc - argnum < 6)
 		    || (*argv[argnum+1]=='\0')
 		    || (*argv[argnum+2]=='\0')
 		    || (*argv[argnum+3]=='\0')
@@ -459,7 +842,7 @@ main(int argc, char **argv){
 
 	      tmp = strtoul(argv[argnum+1], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "f_addr", argv[argc+1]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "f_addr", argv[argnum+1]);
 		 break;
 	      }
 	      f_addr = (unsigned)tmp;
@@ -468,7 +851,7 @@ main(int argc, char **argv){
 	      for (i=0; i<4; i++) {
 		 tmp = strtoul(argv[argnum+2+i], &endptr, 0);
 		 if (*endptr != '\0') {
-		    gpsd_report(LOG_ERROR, "malformed r%u `%s`\n", i, argv[argc+2+i]);
+		    gpsd_report(LOG_ERROR, "malformed r%u `%s`\n", i, argv[argnum+2+i]);
 		    i_err=1;
 		    break;
 		 }
@@ -491,7 +874,7 @@ main(int argc, char **argv){
 	      unsigned addr;
 	      char *endptr;
 
-	      if ((argc < 2)
+	      if ((argc - argnum < 2)
 		    || (*argv[argnum+1]=='\0')) {
 		 gpsd_report(LOG_ERROR, "address not defined\n");
 		 break;
@@ -499,7 +882,7 @@ main(int argc, char **argv){
 
 	      addr = strtoul(argv[argnum+1], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "addr", argv[argc+1]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "addr", argv[argnum+1]);
 		 break;
 	      }
 	      res = cmd_erase_sector(pfd, addr);
@@ -510,7 +893,7 @@ main(int argc, char **argv){
 	      unsigned addr, word;
 	      char *endptr;
 
-	      if ((argc < 1+2)
+	      if ((argc - argnum < 1+2)
 		    || (*argv[argnum+1]=='\0')
 		    ) {
 		 gpsd_report(LOG_ERROR, "address not defined\n");
@@ -519,12 +902,12 @@ main(int argc, char **argv){
 
 	      addr = strtoul(argv[argnum+1], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "addr", argv[argc+1]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "addr", argv[argnum+1]);
 		 break;
 	      }
 	      word = strtoul(argv[argnum+2], &endptr, 0);
 	      if (*endptr != '\0') {
-		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "word", argv[argc+1]);
+		 gpsd_report(LOG_ERROR, "malformed %s `%s`\n", "word", argv[argnum+2]);
 		 break;
 	      }
 
@@ -533,7 +916,7 @@ main(int argc, char **argv){
 		 break;
 	      argnum += 1+2;
 	   }else if (strcasecmp(argv[argnum], "program") == 0) {
-	      if ((argc < 1+1)
+	      if ((argc - argnum < 1+1)
 		    || (*argv[argnum+1]=='\0')
 		    ) {
 		 gpsd_report(LOG_ERROR, "filename not defined\n");
@@ -549,6 +932,133 @@ main(int argc, char **argv){
 	   }
 	}
 
+	return res;
+}
+
+/* Command line received by the server. Dumps go to the client */
+static int
+server_command(int pfd, struct termios *term, int argc, char **argv){
+	return run_commands(pfd, term, argc, argv, NULL);
+}
+
+int
+main(int argc, char **argv){
+
+	int ch;
+	int pfd;
+	int res = 0;
+	char *port = DEFAULT_PORT;
+	char *out_fname = NULL;
+	char *sock_name = NULL;
+	struct termios term;
+
+	progname = argv[0];
+
+	while ((ch = getopt(argc, argv, "l:s:Vv:p:niw:b:c:m:Zo:d:")) != -1)
+		switch (ch) {
+		case 'l':
+			link_cfg.lname = optarg;
+			break;
+		case 's':
+			link_cfg.bname = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+	        case 'n':
+			link_cfg.inject_loader = 0;
+			break;
+	        case 'i':
+			link_cfg.switch_from_sirf = 0;
+			break;
+		case 'w':
+			link_cfg.window = (unsigned)atoi(optarg);
+			break;
+		case 'b':
+			link_cfg.speed = atoi(optarg);
+			break;
+		case 'c':
+			if (strcasecmp(optarg, "sum") == 0)
+			   link_cfg.fcs = MDPROTO_FCS_SUM8;
+			else if (strcasecmp(optarg, "crc16") == 0)
+			   link_cfg.fcs = MDPROTO_FCS_CRC16;
+			else if (strcasecmp(optarg, "crc32") == 0)
+			   link_cfg.fcs = MDPROTO_FCS_CRC32;
+			else {
+			   gpsd_report(LOG_ERROR, "unknown frame check `%s`\n", optarg);
+			   exit(1);
+			}
+			break;
+		case 'm':
+			link_cfg.mtu = (unsigned)atoi(optarg);
+			if ((link_cfg.mtu < MDPROTO_CMD_MAX_RAW_DATA_SIZE)
+			      || (link_cfg.mtu > MDPROTO_MTU_MAX)) {
+			   gpsd_report(LOG_ERROR, "wrong frame size `%s`\n", optarg);
+			   exit(1);
+			}
+			break;
+		case 'Z':
+			link_cfg.compress = 0;
+			break;
+		case 'o':
+			out_fname = optarg;
+			break;
+		case 'd':
+			sock_name = optarg;
+			break;
+		case 'V':
+			version();
+			exit(0);
+		default:
+			help();
+			exit(0);
+			/* NOTREACHED */
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	/* Open the serial port, blocking is OK */
+	if((pfd = open(port, O_RDWR | O_NOCTTY , 0600)) == -1) {
+		gpsd_report(LOG_ERROR, "open(%s) failed: %s\n", port, strerror(errno));
+		return 1;
+	}
+
+	memset(&term, 0, sizeof(term));
+
+	if (link_cfg.inject_loader
+	      && (!link_cfg.switch_from_sirf || !loader_reuse(pfd, &term))) {
+	   res = inject_loader(pfd, &term, link_cfg.lname, link_cfg.switch_from_sirf);
+	   if (res != 0)
+	      goto end;
+	}
+
+	link_setup(pfd, &term);
+
+	if (sock_name != NULL)
+	   res = server_run(pfd, &term, sock_name, server_command);
+	else
+	   res = run_commands(pfd, &term, argc, argv, out_fname);
+
+	/* Default link settings: the next invocation reuses the loader */
+	if (mdproto_link.window) {
+	   uint32_t credits = 0;
+	   mdproto_set_param(pfd, MDPROTO_PARAM_WINDOW, &credits);
+	}
+	if (mdproto_link.fcs != MDPROTO_FCS_SUM8) {
+	   uint32_t value = MDPROTO_FCS_SUM8;
+	   mdproto_set_param(pfd, MDPROTO_PARAM_FCS, &value);
+	}
+	if (mdproto_link.mtu != MDPROTO_CMD_MAX_RAW_DATA_SIZE) {
+	   uint32_t mtu = MDPROTO_CMD_MAX_RAW_DATA_SIZE;
+	   mdproto_set_param(pfd, MDPROTO_PARAM_MTU, &mtu);
+	}
+	if (link_cfg.cur_speed != LOADER_SPEED)
+	   mdproto_set_baud(pfd, &term, LOADER_SPEED);
+
 end:
 	close (pfd);
 	/* return() from main(), to take advantage of SSP compilers */